@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/acpi.h>
+#include <kernel/debug.h>
+#include <kernel/init.h>
+#include <kernel/klibc/memory.h>
+#include <kernel/memory/vmm.h>
+#include <libs/limine/limine.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+__attribute__((used, section(".limine_requests"))) volatile struct limine_rsdp_request
+    limine_rsdp_request
+    = {.id = LIMINE_RSDP_REQUEST, .revision = 0};
+
+/*
+ * Root System Description Pointer.
+ * See the ACPI Specification 6.5, Section 5.2.5.3.
+ */
+typedef struct
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    /* Fields below are only valid from revision 2 */
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+static acpi_sdt_header_t *_root_table;
+static bool _root_is_xsdt;
+
+static bool _checksum_valid(const void *table, size_t length)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+        sum += ((const uint8_t *) table)[i];
+    return sum == 0;
+}
+
+void __init acpi_init()
+{
+    debug_log("[*] Initializing ACPI...\n");
+
+    struct limine_rsdp_response *response = limine_rsdp_request.response;
+    if (response == NULL || response->address == NULL) {
+        debug_log("[-] The bootloader did not find an RSDP\n");
+        return;
+    }
+
+    /* Recent revisions of the boot protocol give a physical address */
+    uintptr_t rsdp_addr = (uintptr_t) response->address;
+    if (rsdp_addr < (uintptr_t) vmm_get_hhdm_addr(NULL))
+        rsdp_addr = (uintptr_t) vmm_get_hhdm_addr((void *) rsdp_addr);
+    acpi_rsdp_t *rsdp = (acpi_rsdp_t *) rsdp_addr;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0) {
+        _root_table = vmm_get_hhdm_addr((void *) rsdp->xsdt_address);
+        _root_is_xsdt = true;
+    } else {
+        _root_table = vmm_get_hhdm_addr((void *) (uintptr_t) rsdp->rsdt_address);
+        _root_is_xsdt = false;
+    }
+
+    if (!_checksum_valid(_root_table, _root_table->length)) {
+        debug_log("[-] The ACPI root table checksum is invalid\n");
+        _root_table = NULL;
+        return;
+    }
+
+    debug_log_fmt(
+        "[+] Found the %s at 0x%x (ACPI revision %d)\n",
+        _root_is_xsdt ? "XSDT" : "RSDT",
+        _root_table,
+        rsdp->revision);
+}
+
+acpi_sdt_header_t *acpi_find_table(const char *signature)
+{
+    if (_root_table == NULL)
+        return NULL;
+
+    size_t entry_size = _root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t entry_count = (_root_table->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    uint8_t *entries = (uint8_t *) _root_table + sizeof(acpi_sdt_header_t);
+
+    for (size_t i = 0; i < entry_count; i++) {
+        uint64_t table_addr = 0;
+        memcpy(&table_addr, entries + i * entry_size, entry_size);
+        acpi_sdt_header_t *table = vmm_get_hhdm_addr((void *) table_addr);
+        if (memcmp(table->signature, signature, 4) != 0)
+            continue;
+        if (!_checksum_valid(table, table->length)) {
+            debug_log_fmt("[!] Ignoring the %s table, its checksum is invalid\n", signature);
+            continue;
+        }
+        return table;
+    }
+    return NULL;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Common header of the ACPI system description tables.
+ * See the ACPI Specification 6.5, Section 5.2.6.
+ */
+typedef struct
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+/*
+ * Locate the ACPI root table from the RSDP given by the bootloader.
+ */
+void acpi_init();
+
+/*
+ * Returns the first table with the given 4 character signature, or NULL if there
+ * is none or its checksum is wrong.
+ */
+acpi_sdt_header_t *acpi_find_table(const char *signature);
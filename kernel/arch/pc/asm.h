@@ -11,7 +11,11 @@ void asm_invlpg(void *virt_addr);
 uintptr_t asm_read_cr2();
 uintptr_t asm_read_cr3();
 void asm_write_cr3(uintptr_t value);
+uintptr_t asm_read_cr4();
+void asm_write_cr4(uintptr_t value);
 void asm_hlt();
 void asm_outb(unsigned char value, unsigned short int port);
 unsigned char asm_inb(unsigned short int port);
 uintptr_t asm_read_rsp();
+void asm_zero_page_nt(void *page);
+uint64_t asm_rdtsc();
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Maximum number of logical processors the kernel keeps per-CPU state for.
+ */
+#define MAX_CPUS 16
+
+/*
+ * Geometry of a processor cache.
+ */
+typedef struct
+{
+    int level;
+    size_t size;      /* Total size in bytes */
+    size_t line_size; /* Cache line size in bytes */
+    size_t ways;      /* Associativity */
+    size_t sets;
+} cpu_cache_info_t;
+
+/*
+ * Returns the index of the processor executing the caller, in [0, MAX_CPUS).
+ */
+uint32_t cpu_get_id();
+
+/*
+ * Returns the initial local APIC ID of the processor executing the caller.
+ */
+uint32_t cpu_get_apic_id();
+
+/*
+ * Disable interrupts on the processor executing the caller.
+ * Returns the previous RFLAGS, to be given to cpu_irq_restore.
+ */
+uint64_t cpu_irq_save();
+
+/*
+ * Re-enable interrupts if they were enabled when cpu_irq_save returned flags.
+ */
+void cpu_irq_restore(uint64_t flags);
+
+/*
+ * Describe the last level data or unified cache of the processor executing the caller,
+ * using CPUID leaf 4 (or its AMD counterpart, leaf 0x8000001D).
+ * Returns false if the processor does not report its cache geometry.
+ */
+bool cpu_get_llc_info(cpu_cache_info_t *info);
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define IDT_TYPE_INTERRUPT 0x8E
@@ -67,6 +68,11 @@ void isr_handler(struct interrupt_registers *);
  */
 void irq_handler(struct interrupt_registers *);
 
+/*
+ * Returns true while the calling CPU is running an IRQ handler.
+ */
+bool in_irq();
+
 /*
  * Register an IRQ Service Routine
  * https://wiki.osdev.org/Interrupts
@@ -39,6 +39,24 @@ typedef struct
     page_table_entry_t entries[512];
 } page_table_t;
 
+/*
+ * Bits of an entry holding the address of a page or of the next table.
+ */
+#define PT_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/*
+ * Leaf entries of the PDPT and PD map 1 GiB and 2 MiB pages. Their PAT bit moves
+ * from bit 7, which marks them as leaves, to bit 12.
+ * Check Intel's x86 Developer Manual Volume 3A, Section 5.5.4, Table 5-16 and 5-18.
+ */
+#define PT_HUGE_PAGE (1 << 7)
+#define PT_HUGE_PAT (1 << 12)
+
+/*
+ * Bytes mapped by one entry of a table of the given level, 0 being the page table.
+ */
+#define PML_ENTRY_SIZE(LEVEL) (1ULL << (12 + (LEVEL) * 9))
+
 #define PML_GET_INDEX(ADDR, LEVEL) \
     (((uint64_t) ADDR & ((uint64_t) 0x1ff << (12 + LEVEL * 9))) >> (12 + LEVEL * 9))
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <kernel/arch/pc/cpu.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Test-and-test-and-set spinlock. Zero-initialized locks are unlocked.
+ */
+typedef struct
+{
+    volatile uint32_t locked;
+    size_t contentions; /* Times the lock was found taken */
+} spinlock_t;
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    __atomic_fetch_add(&lock->contentions, 1, __ATOMIC_RELAXED);
+    do {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            __builtin_ia32_pause();
+    } while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) != 0);
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a lock with interrupts disabled, so that an interrupt handler on the same
+ * processor cannot spin on it forever.
+ * Returns the flags to give to spin_unlock_irqrestore.
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint64_t flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
@@ -6,8 +6,9 @@
 #include <kernel/arch/pc/idt.h>
 #include <kernel/arch/pc/pit.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/klibc/string.h>
-#include <kernel/memory/heap.h>
+#include <kernel/memory/slab.h>
 #include <kernel/terminal/kshell.h>
 #include <kernel/terminal/terminal.h>
 #include <kernel/timer.h>
@@ -22,10 +23,14 @@ struct timer_block
 };
 
 static timer_block_t *_base;
+static volatile uint64_t _ticks = 0;
+static kmem_cache_t *_timer_block_cache;
 
 static timer_block_t *_new_time_block(uint64_t duration)
 {
-    timer_block_t *new_block = kmalloc(sizeof(timer_block_t));
+    timer_block_t *new_block = kmem_cache_alloc(_timer_block_cache);
+    if (new_block == NULL)
+        return NULL;
     new_block->countdown = duration;
     if (_base == NULL) {
         _base = new_block;
@@ -41,22 +46,22 @@ static void _timer_irq()
 {
     timer_block_t *current = _base;
     timer_block_t *prev = NULL;
+    _ticks++;
 
+    /* Expired blocks are unlinked here and freed by their sleeper */
     while (current != NULL) {
+        if (current->countdown > 0)
+            current->countdown--;
         if (current->countdown == 0) {
-            timer_block_t *temp = current;
             if (prev == NULL) {
                 _base = current->next;
             } else {
                 prev->next = current->next;
             }
-            current = current->next;
-            kfree(temp);
         } else {
-            current->countdown--;
             prev = current;
-            current = current->next;
         }
+        current = current->next;
     }
 }
 
@@ -70,18 +75,30 @@ static void _sleep_cmd(int argc, char *argv[])
     sleep(duration);
 }
 
-void timer_init()
+void __init timer_init()
 {
     debug_log("[*] Initializing the timer\n");
+    _timer_block_cache = kmem_cache_create("timer_block", sizeof(timer_block_t), 0, NULL);
     pit_set_frequency(1000);
     irq_register_handler(0, _timer_irq);
     kshell_register_command("sleep", "Sleep for a specified duration", _sleep_cmd);
     debug_log("[+] Initialized the timer\n");
 }
 
+uint64_t timer_get_ticks()
+{
+    return _ticks;
+}
+
 void sleep(uint64_t ms)
 {
+    if (ms == 0)
+        return;
+
     timer_block_t *block = _new_time_block(ms);
+    if (block == NULL)
+        return;
     while (block->countdown > 0)
         __asm__("hlt");
+    kmem_cache_free(_timer_block_cache, block);
 }
@@ -23,6 +23,16 @@ asm_write_cr3:
     mov cr3, rdi
     ret
 
+global asm_read_cr4
+asm_read_cr4:
+    mov rax, cr4
+    ret
+
+global asm_write_cr4
+asm_write_cr4:
+    mov cr4, rdi
+    ret
+
 global asm_hlt
 asm_hlt:
     hlt
@@ -45,3 +55,32 @@ global asm_read_rsp
 asm_read_rsp:
     mov rax, rsp
     ret
+
+; Zero a 4 KiB page with non-temporal stores, so that zeroing
+; does not evict useful data from the caches.
+global asm_zero_page_nt
+asm_zero_page_nt:
+    xor eax, eax
+    mov ecx, 4096 / 64
+.loop:
+    movnti [rdi], rax
+    movnti [rdi + 8], rax
+    movnti [rdi + 16], rax
+    movnti [rdi + 24], rax
+    movnti [rdi + 32], rax
+    movnti [rdi + 40], rax
+    movnti [rdi + 48], rax
+    movnti [rdi + 56], rax
+    add rdi, 64
+    dec ecx
+    jnz .loop
+    sfence
+    ret
+
+global asm_rdtsc
+asm_rdtsc:
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/cpu.h>
+
+#define RFLAGS_IF (1 << 9)
+
+#define CPUID_CACHE_TYPE_NULL 0
+#define CPUID_CACHE_TYPE_INSTRUCTION 2
+
+static inline void _cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                     : "a"(leaf), "c"(subleaf));
+}
+
+uint32_t cpu_get_id()
+{
+    /* Application processors are not started yet, everything runs on the BSP */
+    return 0;
+}
+
+uint32_t cpu_get_apic_id()
+{
+    uint32_t regs[4];
+    _cpuid(1, 0, regs);
+    return regs[1] >> 24;
+}
+
+uint64_t cpu_irq_save()
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void cpu_irq_restore(uint64_t flags)
+{
+    if (flags & RFLAGS_IF)
+        __asm__ volatile("sti" : : : "memory");
+}
+
+/*
+ * Walks the deterministic cache parameters of a CPUID leaf and keeps the highest
+ * level data or unified cache.
+ */
+static bool _read_cache_leaf(uint32_t leaf, cpu_cache_info_t *info)
+{
+    bool found = false;
+    for (uint32_t subleaf = 0; subleaf < 16; subleaf++) {
+        uint32_t regs[4];
+        _cpuid(leaf, subleaf, regs);
+
+        uint32_t type = regs[0] & 0x1F;
+        if (type == CPUID_CACHE_TYPE_NULL)
+            break;
+        if (type == CPUID_CACHE_TYPE_INSTRUCTION)
+            continue;
+
+        int level = (regs[0] >> 5) & 0x7;
+        if (found && level <= info->level)
+            continue;
+
+        info->level = level;
+        info->line_size = (regs[1] & 0xFFF) + 1;
+        info->ways = ((regs[1] >> 22) & 0x3FF) + 1;
+        info->sets = (size_t) regs[2] + 1;
+        info->size = info->ways * (((regs[1] >> 12) & 0x3FF) + 1) * info->line_size * info->sets;
+        found = true;
+    }
+    return found;
+}
+
+bool cpu_get_llc_info(cpu_cache_info_t *info)
+{
+    uint32_t regs[4];
+
+    _cpuid(0, 0, regs);
+    if (regs[0] >= 4 && _read_cache_leaf(4, info))
+        return true;
+
+    _cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x8000001D && _read_cache_leaf(0x8000001D, info))
+        return true;
+
+    return false;
+}
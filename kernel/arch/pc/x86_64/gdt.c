@@ -6,6 +6,7 @@
 #include <kernel/arch/pc/gdt.h>
 #include <kernel/arch/pc/x86_64/tss.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 
 /*
  * Global Descriptor Table Entry Descriptor.
@@ -55,7 +56,7 @@ struct
 
 static tss_entry_t _tss = {0};
 
-void gdt_init()
+void __init gdt_init()
 {
     debug_log("[*] Initializing the GDT...\n");
 
@@ -4,11 +4,14 @@
  */
 
 #include <kernel/arch/pc/asm.h>
+#include <kernel/arch/pc/cpu.h>
 #include <kernel/arch/pc/idt.h>
 #include <kernel/arch/pc/morse_debug.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/klibc/string.h>
+#include <kernel/usermode/fault.h>
 #include <kernel/video/panic.h>
 
 /*
@@ -43,6 +46,7 @@ static struct
 static idt_entry_t _idt_entries[256];
 
 static void *_irq_routines[16] = {NULL};
+static uint32_t _irq_depth[MAX_CPUS]; /* Nested IRQ handlers running on each CPU */
 
 extern void _isr0();
 extern void _isr1();
@@ -94,7 +98,7 @@ extern void _irq13();
 extern void _irq14();
 extern void _irq15();
 
-void idt_init()
+void __init idt_init()
 {
     debug_log("[*] Initializing the IDT...\n");
 
@@ -227,6 +231,10 @@ static const char *error_messages[] = {
 
 void isr_handler(struct interrupt_registers *regs)
 {
+    /* Pages of user tasks are mapped when first touched */
+    if (regs->isr_number == 14 && page_fault_handle(asm_read_cr2(), regs->error_code))
+        return;
+
     if (regs->isr_number < 32) {
         uint8_t tmp = asm_inb(0x61);
         if (tmp != (tmp | 3)) {
@@ -268,6 +276,11 @@ void isr_handler(struct interrupt_registers *regs)
     }
 }
 
+bool in_irq()
+{
+    return _irq_depth[cpu_get_id()] != 0;
+}
+
 void irq_register_handler(const uint8_t irq, void *handler)
 {
     _irq_routines[irq] = handler;
@@ -280,9 +293,12 @@ void irq_unregister_handler(const uint8_t irq)
 
 void irq_handler(struct interrupt_registers *reg)
 {
+    uint32_t cpu = cpu_get_id();
     void (*handler)(struct interrupt_registers *) = _irq_routines[reg->isr_number - 32];
+    _irq_depth[cpu]++;
     if (handler)
         handler(reg);
+    _irq_depth[cpu]--;
     if (reg->isr_number >= 40)
         asm_outb(0x20, 0xA0);
     asm_outb(0x20, 0x20);
@@ -56,6 +56,8 @@ extern sys_file_getstats
 extern sys_file_tell
 extern sys_getdrives
 extern sys_exit
+extern sys_fork
+extern _syscall_frame
 
 section .rodata
 syscall_table:
@@ -75,6 +77,7 @@ syscall_table:
     dq sys_file_tell
     dq sys_getdrives
     dq sys_exit
+    dq sys_fork
 syscall_table_end:
 
 section .text
@@ -82,10 +85,16 @@ global _syscall_handler
 _syscall_handler:
     cmp rax, (syscall_table_end-syscall_table) / 8
     jge .invalid
+    push 0                ; error code placeholder
+    push 0x80             ; interrupt vector
+    push fs               ; core placeholder
     PUSHALL
+    mov [_syscall_frame], rsp
     xor rbp, rbp
     call [syscall_table + rax * 8]
+    mov [rsp + 14 * 8], rax ; return value, in place of the saved rax
     POPALL
+    add rsp, 24
     iretq
 .invalid
     mov rax, -1
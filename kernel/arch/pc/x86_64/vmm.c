@@ -6,6 +6,7 @@
 #include <kernel/arch/pc/asm.h>
 #include <kernel/arch/pc/paging.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/klibc/string.h>
 #include <kernel/memory/pmm.h>
@@ -25,25 +26,74 @@ __attribute__((used, section(".limine_requests"))) volatile struct limine_paging
     limine_paging_request
     = {.id = LIMINE_PAGING_MODE_REQUEST, .mode = LIMINE_PAGING_MODE_X86_64_4LVL, .revision = 0};
 
+/*
+ * Largest range whose TLB entries are invalidated page by page. Larger ranges reload
+ * CR3, which is cheaper than that many invlpg.
+ */
+#define VMM_INVLPG_MAX_PAGES 32
+
+/*
+ * Number of PCIDs handed out to address spaces. When they run out, the address space
+ * that got its PCID the longest ago loses it and its TLB entries.
+ */
+#define VMM_PCID_COUNT 64
+
+#define KERNEL_HALF_START 0xFFFF800000000000ULL
+#define KERNEL_HALF_FIRST_ENTRY 256
+
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+/* Top level table of the kernel address space, whose kernel half every other one shares */
 static page_table_t *_pt_top_level;
+static uintptr_t _kernel_space;
+static uintptr_t _current_space;
+static size_t _space_count = 1;
+
+static uint64_t _global_flag; /* PTFLAG_G if the CPU supports global pages */
+static bool _global_pages;
+static bool _pcid_enabled;
+static uintptr_t _pcid_owners[VMM_PCID_COUNT];
+static size_t _pcid_next = 1;
+static size_t _pcid_reuses = 0;  /* Switches that kept the TLB entries of the address space */
+static size_t _pcid_flushes = 0; /* Switches that had to take a PCID and flush it */
+static size_t _switch_skips = 0; /* Switches to the address space already loaded */
+
+/* Copied from the bootloader responses, which do not survive boot memory reclaim */
+static uint64_t _hhdm_offset;
+static uint64_t _paging_mode;
+static uintptr_t _kernel_paddr;
+static uintptr_t _kernel_vaddr;
+
+static bool _has_1g_pages;
+static size_t _table_count = 0; /* Page tables allocated so far */
+
+/* Leaf entries written by vmm_init for the direct map, by table level */
+static size_t _boot_pages[3];
+static size_t _boot_tables;
 
 extern void *_limine_requests_start;
 extern void *_limine_requests_end;
 extern void *_text_start;
 extern void *_text_end;
+extern void *_init_text_start;
+extern void *_init_text_end;
 extern void *_data_start;
 extern void *_data_end;
+extern void *_init_data_start;
+extern void *_init_data_end;
 extern void *_rodata_start;
 extern void *_rodata_end;
 
 void *vmm_get_hhdm_addr(void *phys_addr)
 {
-    return limine_hhdm_request.response->offset + phys_addr;
+    return _hhdm_offset + phys_addr;
 }
 
 void *vmm_get_lhdm_addr(void *virt_addr)
 {
-    return virt_addr - limine_hhdm_request.response->offset;
+    return virt_addr - _hhdm_offset;
 }
 
 static void _vmmap_command(int argc, char *argv[])
@@ -60,56 +110,71 @@ static void _vmmap_command(int argc, char *argv[])
     vmm_map(virt, phys, flags, true);
 }
 
-static void _vminfo_command(int, char **)
+/*
+ * Counts a table and the tables below it by level, and the pages they map by size.
+ */
+static void _count_tables(page_table_t *table, int level, size_t tables[4], size_t pages[3])
 {
-    size_t present_pml5_entries = 0, present_pml4_entries = 0, present_pml3_entries = 0,
-           present_pml2_entries = 0, present_pml1_entries = 0;
-
-    /* Count present entries at each level.
-     * I know this code is cursed, but it (probably) works.
-     * TODO: refactor this shit.
-     */
+    tables[level]++;
     for (int i = 0; i < 512; i++) {
-        if (_pt_top_level->entries[i].flags.present) {
-            present_pml4_entries++;
-            page_table_t *pml3 = vmm_get_hhdm_addr(
-                (void *) (_pt_top_level->entries[i].raw & ~0xFFF));
-            for (int j = 0; j < 512; j++) {
-                if (pml3->entries[j].flags.present) {
-                    present_pml3_entries++;
-                    page_table_t *pml2 = vmm_get_hhdm_addr((void *) (pml3->entries[j].raw & ~0xFFF));
-                    for (int k = 0; k < 512; k++) {
-                        if (pml2->entries[k].flags.present) {
-                            present_pml2_entries++;
-                            page_table_t *pml1 = vmm_get_hhdm_addr(
-                                (void *) (pml2->entries[k].raw & ~0xFFF));
-                            for (int l = 0; l < 512; l++) {
-                                if (pml1->entries[l].flags.present) {
-                                    present_pml1_entries++;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        page_table_entry_t entry = table->entries[i];
+        if (!entry.flags.present)
+            continue;
+        if (level == 0 || (level < 3 && entry.flags.huge_page)) {
+            pages[level]++;
+            continue;
         }
+        _count_tables(
+            vmm_get_hhdm_addr((void *) (entry.raw & PT_ADDR_MASK)), level - 1, tables, pages);
     }
+}
+
+static void _vminfo_command(int, char **)
+{
+    size_t tables[4] = {0};
+    size_t pages[3] = {0};
+    _count_tables(vmm_get_hhdm_addr((void *) _current_space), 3, tables, pages);
 
-    size_t total_mapped_pages = present_pml5_entries + present_pml4_entries + present_pml3_entries
-                                + present_pml2_entries + present_pml1_entries;
-    size_t total_mapped_memory_mb = total_mapped_pages * PAGE_SIZE / 1048576;
+    size_t total_mapped_memory_mb = pages[0] * PAGE_SIZE / 1048576 + pages[1] * 2 + pages[2] * 1024;
+
+    /* Every 2 MiB page spares a page table, every 1 GiB page a PD and 512 page tables */
+    size_t saved_tables = _boot_pages[1] + _boot_pages[2] * 513;
+    size_t saved_entries = _boot_pages[1] * 511 + _boot_pages[2] * (512 * 512 - 1);
 
     kprintf("\n[*] Virtual Memory Information:\n");
-    kprintf("[*] Page Table Top Level Address: 0x%x\n", _pt_top_level);
+    kprintf("[*] Page Table Top Level Address: 0x%x\n", vmm_get_hhdm_addr((void *) _current_space));
     kprintf("[*] Page Size: %d bytes\n", PAGE_SIZE);
-    if (limine_paging_request.response->mode == LIMINE_PAGING_MODE_X86_64_5LVL)
-        kprintf("[*] Present PML5 Entries: %d\n", present_pml5_entries);
-    kprintf("[*] Present PML4 Entries: %d\n", present_pml4_entries);
-    kprintf("[*] Present PML3 Entries: %d\n", present_pml3_entries);
-    kprintf("[*] Present PML2 Entries: %d\n", present_pml2_entries);
-    kprintf("[*] Present PML1 Entries: %d\n", present_pml1_entries);
-    kprintf("[*] Total mapped pages: %d\n", total_mapped_pages);
+    kprintf(
+        "[*] Page tables: %d PML4, %d PDPT, %d PD, %d PT (%d allocated)\n",
+        tables[3],
+        tables[2],
+        tables[1],
+        tables[0],
+        _table_count);
+    kprintf(
+        "[*] Mapped pages: %d of 1 GiB, %d of 2 MiB, %d of 4 KiB\n", pages[2], pages[1], pages[0]);
     kprintf("[*] Total mapped memory: %d MB\n", total_mapped_memory_mb);
+    kprintf(
+        "[*] Direct map at boot: %d of 1 GiB, %d of 2 MiB, %d of 4 KiB in %d page tables\n",
+        _boot_pages[2],
+        _boot_pages[1],
+        _boot_pages[0],
+        _boot_tables);
+    kprintf(
+        "[*] Saved by large pages: %d page tables (%d KB), %d entries\n",
+        saved_tables,
+        saved_tables * PAGE_SIZE / 1024,
+        saved_entries);
+    kprintf(
+        "[*] Address spaces: %d, PCIDs %s, global kernel pages %s\n",
+        _space_count,
+        _pcid_enabled ? "enabled" : "disabled",
+        _global_pages ? "enabled" : "disabled");
+    kprintf(
+        "[*] Address space switches: %d kept their TLB entries, %d flushed, %d skipped\n",
+        _pcid_reuses,
+        _pcid_flushes,
+        _switch_skips);
 }
 
 static inline void _asm_write_msr(uint32_t msr, uint64_t value)
@@ -124,7 +189,7 @@ static inline void _asm_cpuid(uint32_t eax, uint32_t *a, uint32_t *b, uint32_t *
     __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(eax));
 }
 
-static void _set_pat(void)
+static void __init _set_pat(void)
 {
     uint32_t eax, ebx, ecx, edx;
     _asm_cpuid(1, &eax, &ebx, &ecx, &edx);
@@ -142,34 +207,137 @@ static void _set_pat(void)
     _asm_write_msr(0x277, pat_value);
 }
 
-void vmm_init(struct limine_memmap_response *memmap_response)
+/*
+ * Returns whether the CPU supports 1 GiB pages.
+ */
+static bool __init _detect_1g_pages(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    _asm_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001)
+        return false;
+    _asm_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 26);
+}
+
+/*
+ * Enables global pages for the kernel half, and PCIDs if global pages are there to
+ * keep the kernel half valid in every PCID.
+ */
+static void __init _enable_tlb_features(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    _asm_cpuid(1, &eax, &ebx, &ecx, &edx);
+    uintptr_t cr4 = asm_read_cr4();
+    if (_global_flag != 0) {
+        cr4 |= CR4_PGE;
+        _global_pages = true;
+    }
+    if (_global_pages && (ecx & (1 << 17))) {
+        /* CR3 holds PCID 0 for the kernel address space when PCIDs are enabled */
+        cr4 |= CR4_PCIDE;
+        _pcid_enabled = true;
+        _pcid_owners[0] = _kernel_space;
+    }
+    asm_write_cr4(cr4);
+    debug_log_fmt(
+        "[*] Global pages %s, PCIDs %s\n",
+        _global_pages ? "enabled" : "not supported",
+        _pcid_enabled ? "enabled" : "not supported");
+}
+
+static void *_get_next_level(page_table_entry_t *entry, int level);
+static bool _map_huge_page(uintptr_t virt, uintptr_t phys, int level, uint64_t flags);
+
+/*
+ * Maps a range of physical memory in the direct map with the largest pages its
+ * alignment allows, and 4 KiB pages at its edges.
+ */
+static void __init _map_direct_range(uintptr_t phys, size_t length)
+{
+    uintptr_t end = PAGE_UP(phys + length);
+    phys = PAGE_DOWN(phys);
+    debug_log_fmt(
+        "[*] Mapping 0x%x - 0x%x to 0x%x - 0x%x\n",
+        phys,
+        end,
+        vmm_get_hhdm_addr((void *) phys),
+        vmm_get_hhdm_addr((void *) end));
+
+    while (phys < end) {
+        uintptr_t virt = (uintptr_t) vmm_get_hhdm_addr((void *) phys);
+        int level = _has_1g_pages ? 2 : 1;
+        for (; level > 0; level--) {
+            uint64_t size = PML_ENTRY_SIZE(level);
+            if (((phys | virt) & (size - 1)) == 0 && end - phys >= size)
+                break;
+        }
+
+        if (level == 0)
+            vmm_map(virt, phys, PTFLAG_P | PTFLAG_RW, false);
+        else if (!_map_huge_page(virt, phys, level, PTFLAG_P | PTFLAG_RW))
+            debug_log_fmt("[-] Failed to map physical address 0x%x in the direct map\n", phys);
+        _boot_pages[level]++;
+        phys += PML_ENTRY_SIZE(level);
+    }
+}
+
+void __init vmm_early_init()
+{
+    _hhdm_offset = limine_hhdm_request.response->offset;
+    /* Without a response the bootloader left the default, which is 4-level paging */
+    _paging_mode = limine_paging_request.response != NULL ? limine_paging_request.response->mode
+                                                          : LIMINE_PAGING_MODE_X86_64_4LVL;
+    _kernel_paddr = limine_kernel_address_request.response->physical_base;
+    _kernel_vaddr = limine_kernel_address_request.response->virtual_base;
+}
+
+void __init vmm_init(struct limine_memmap_response *memmap_response)
 {
     debug_log("[*] Initializing VMM...\n");
+    /* The page table walks below only know 4 levels */
+    if (_paging_mode != LIMINE_PAGING_MODE_X86_64_4LVL) {
+        debug_log("[-] The bootloader enabled 5-level paging, which is not supported\n");
+        while (1)
+            __asm__("hlt");
+    }
     debug_log("[*] Using Level-4 paging\n");
 
-    _pt_top_level = pmm_alloc(1);
+    _pt_top_level = pmm_alloc_zeroed(1);
     if (_pt_top_level == NULL) {
         debug_log_fmt("[-] Failed to initialize the VMM");
         while (1)
             __asm__("hlt");
     }
+    _kernel_space = (uintptr_t) _pt_top_level;
+    _current_space = _kernel_space;
     _pt_top_level = vmm_get_hhdm_addr(_pt_top_level);
-    memset(_pt_top_level, 0, PAGE_SIZE);
+    _table_count = 1;
+
+    uint32_t eax, ebx, ecx, edx;
+    _asm_cpuid(1, &eax, &ebx, &ecx, &edx);
+    _global_flag = edx & (1 << 13) ? PTFLAG_G : 0;
+    _has_1g_pages = _detect_1g_pages();
+    if (!_has_1g_pages)
+        debug_log("[*] 1 GiB pages not supported, the direct map uses 2 MiB pages\n");
 
     for (uint64_t i = 0; i < memmap_response->entry_count; i++) {
         uint64_t type = memmap_response->entries[i]->type;
         if (type != LIMINE_MEMMAP_BAD_MEMORY) {
-            vmm_map_range(
-                (uintptr_t) vmm_get_hhdm_addr((void *) memmap_response->entries[i]->base),
-                memmap_response->entries[i]->base,
-                memmap_response->entries[i]->length,
-                0x0000000000000003,
-                false);
+            _map_direct_range(
+                memmap_response->entries[i]->base, memmap_response->entries[i]->length);
         }
     }
+    _boot_tables = _table_count;
+    debug_log_fmt(
+        "[*] Direct map: %d pages of 1 GiB, %d of 2 MiB and %d of 4 KiB in %d page tables\n",
+        _boot_pages[2],
+        _boot_pages[1],
+        _boot_pages[0],
+        _boot_tables);
 
-    uintptr_t kernel_paddr = limine_kernel_address_request.response->physical_base;
-    uintptr_t kernel_vaddr = limine_kernel_address_request.response->virtual_base;
+    uintptr_t kernel_paddr = _kernel_paddr;
+    uintptr_t kernel_vaddr = _kernel_vaddr;
 
     uintptr_t limine_requests_start_vaddr = (uintptr_t) &_limine_requests_start;
     uintptr_t limine_requests_start_paddr = limine_requests_start_vaddr - kernel_vaddr
@@ -192,8 +360,18 @@ void vmm_init(struct limine_memmap_response *memmap_response)
     vmm_map_range(rodata_start_vaddr, rodata_start_paddr, rodata_size, 0x03, false);
     vmm_map_range(data_start_vaddr, data_start_paddr, data_size, 0x03, false);
 
+    /* Address spaces copy the kernel half of the PML4, so its entries must all exist now */
+    for (int i = KERNEL_HALF_FIRST_ENTRY; i < 512; i++) {
+        if (_get_next_level(&_pt_top_level->entries[i], 3) == NULL) {
+            debug_log("[-] Failed to create the kernel half of the page table\n");
+            while (1)
+                __asm__("hlt");
+        }
+    }
+
     _set_pat();
-    asm_write_cr3((uintptr_t) vmm_get_lhdm_addr(_pt_top_level));
+    asm_write_cr3(_kernel_space);
+    _enable_tlb_features();
 
     debug_log_fmt("[*] The page table is located at 0x%x\n", _pt_top_level);
     kshell_register_command("vmmap", "Map virtual address to physical address", _vmmap_command);
@@ -202,51 +380,332 @@ void vmm_init(struct limine_memmap_response *memmap_response)
     debug_log("[+] Initialized VMM\n");
 }
 
-static inline void *_get_next_level(page_table_entry_t *entry)
+/*
+ * Flushes every TLB entry, global ones and those of every PCID included.
+ */
+static void _flush_all(void)
+{
+    if (!_global_pages) {
+        asm_write_cr3(asm_read_cr3());
+        return;
+    }
+    uintptr_t cr4 = asm_read_cr4();
+    asm_write_cr4(cr4 & ~CR4_PGE);
+    asm_write_cr4(cr4);
+}
+
+/*
+ * Forgets the PCID of an address space, so that the TLB entries tagged with it are
+ * flushed before the address space is loaded again.
+ */
+static void _pcid_release(uintptr_t space)
+{
+    for (size_t pcid = 0; pcid < VMM_PCID_COUNT; pcid++) {
+        if (_pcid_owners[pcid] == space) {
+            _pcid_owners[pcid] = 0;
+            return;
+        }
+    }
+}
+
+/*
+ * Returns the flags of a leaf entry mapping virt. Kernel mappings are the same in
+ * every address space, so they are global and survive CR3 writes.
+ */
+static inline uint64_t _leaf_flags(uintptr_t virt, uint64_t flags)
+{
+    return virt >= KERNEL_HALF_START ? flags | _global_flag : flags;
+}
+
+static inline page_table_t *_space_table(uintptr_t space)
+{
+    return vmm_get_hhdm_addr((void *) space);
+}
+
+/*
+ * Replaces a 1 GiB or 2 MiB page, held by a table of the given level, by a table of
+ * smaller pages mapping the same memory with the same flags, so that part of it can
+ * be remapped.
+ * Returns the new table, or NULL if no memory is left.
+ */
+static page_table_t *_split_huge_page(page_table_entry_t *entry, int level)
+{
+    void *pt = pmm_alloc(1);
+    if (pt == NULL)
+        return NULL;
+    _table_count++;
+
+    uint64_t phys = entry->raw & PT_ADDR_MASK & ~(PML_ENTRY_SIZE(level) - 1);
+    uint64_t flags = entry->raw & ~PT_ADDR_MASK;
+    if (level == 1) {
+        /* 4 KiB pages keep their PAT bit where large pages have their size bit */
+        flags &= ~PT_HUGE_PAGE;
+        if (entry->raw & PT_HUGE_PAT)
+            flags |= PTFLAG_PAT;
+    } else {
+        flags |= entry->raw & PT_HUGE_PAT;
+    }
+
+    page_table_t *table = vmm_get_hhdm_addr(pt);
+    for (int i = 0; i < 512; i++)
+        table->entries[i].raw = (phys + i * PML_ENTRY_SIZE(level - 1)) | flags;
+    entry->raw = ((uint64_t) pt) | 0b111;
+
+    /* The TLB must not keep the large page next to the small ones that replace it */
+    _flush_all();
+    debug_log_fmt("[*] Split the large page at physical address 0x%x\n", phys);
+    return table;
+}
+
+/*
+ * Returns the table an entry of a table of the given level points to, creating it
+ * if the entry is not present and splitting the page if the entry maps a large one.
+ */
+static void *_get_next_level(page_table_entry_t *entry, int level)
 {
     void *pt;
     if (!entry->flags.present) {
-        pt = pmm_alloc(1);
+        pt = pmm_alloc_zeroed(1);
         if (pt == NULL)
             return NULL;
+        _table_count++;
         entry->raw = ((uint64_t) pt) | 0b111;
         return vmm_get_hhdm_addr(pt);
     }
-    return vmm_get_hhdm_addr((void *) (entry->raw & ~0xFFF));
+    if (entry->flags.huge_page)
+        return _split_huge_page(entry, level);
+    return vmm_get_hhdm_addr((void *) (entry->raw & PT_ADDR_MASK));
 }
 
-void vmm_map(uintptr_t virt, uintptr_t phys, size_t flags, bool flush)
+/*
+ * Maps a 2 MiB (level 1) or 1 GiB (level 2) page in the kernel address space. Both
+ * addresses must be aligned to the size of the page, and nothing may be mapped in
+ * its range yet.
+ */
+static bool _map_huge_page(uintptr_t virt, uintptr_t phys, int level, uint64_t flags)
 {
-    uint64_t pml4_index = PML4_GET_INDEX(virt);
-    uint64_t pdpt_index = PML3_GET_INDEX(virt);
-    uint64_t pdt_index = PML2_GET_INDEX(virt);
-    uint64_t pt_index = PML1_GET_INDEX(virt);
+    page_table_t *table = _pt_top_level;
+    for (int current = 3; current > level; current--) {
+        table = _get_next_level(&table->entries[PML_GET_INDEX(virt, current)], current);
+        if (table == NULL)
+            return false;
+    }
+    table->entries[PML_GET_INDEX(virt, level)].raw = phys | _leaf_flags(virt, flags)
+                                                      | PT_HUGE_PAGE;
+    return true;
+}
 
-    page_table_t *pdpt, *pdt, *pt;
+/*
+ * Frees the tables below the first count entries of a table of the given level.
+ */
+static void _free_tables(page_table_t *table, int level, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        page_table_entry_t entry = table->entries[i];
+        if (!entry.flags.present || (level < 3 && entry.flags.huge_page))
+            continue;
+
+        void *next = (void *) (entry.raw & PT_ADDR_MASK);
+        if (level > 1)
+            _free_tables(vmm_get_hhdm_addr(next), level - 1, 512);
+        pmm_free(next, 1);
+        _table_count--;
+    }
+}
 
-    pdpt = _get_next_level(&_pt_top_level->entries[pml4_index]);
-    if (pdpt == NULL)
-        goto failure;
+uintptr_t vmm_create_address_space()
+{
+    void *pml4 = pmm_alloc_zeroed(1);
+    if (pml4 == NULL)
+        return 0;
+    _table_count++;
+    _space_count++;
+
+    /* The entries of the kernel half were all created at boot and never change */
+    page_table_t *table = vmm_get_hhdm_addr(pml4);
+    memcpy(
+        &table->entries[KERNEL_HALF_FIRST_ENTRY],
+        &_pt_top_level->entries[KERNEL_HALF_FIRST_ENTRY],
+        (512 - KERNEL_HALF_FIRST_ENTRY) * sizeof(page_table_entry_t));
+    return (uintptr_t) pml4;
+}
 
-    pdt = _get_next_level(&pdpt->entries[pdpt_index]);
-    if (pdt == NULL)
-        goto failure;
-    pt = _get_next_level(&pdt->entries[pdt_index]);
-    if (pt == NULL)
-        goto failure;
+void vmm_destroy_address_space(uintptr_t space)
+{
+    if (space == _kernel_space) {
+        debug_log("[!] vmm_destroy_address_space: The kernel address space cannot go\n");
+        return;
+    }
+    if (space == _current_space)
+        vmm_switch_address_space(_kernel_space);
+    _pcid_release(space);
+
+    _free_tables(_space_table(space), 3, KERNEL_HALF_FIRST_ENTRY);
+    pmm_free((void *) space, 1);
+    _table_count--;
+    _space_count--;
+}
+
+void vmm_switch_address_space(uintptr_t space)
+{
+    if (space == _current_space) {
+        _switch_skips++;
+        return;
+    }
+    _current_space = space;
+    if (!_pcid_enabled) {
+        asm_write_cr3(space);
+        return;
+    }
+
+    /* The TLB entries of an address space that kept its PCID are still valid */
+    for (size_t pcid = 0; pcid < VMM_PCID_COUNT; pcid++) {
+        if (_pcid_owners[pcid] == space) {
+            _pcid_reuses++;
+            asm_write_cr3(space | pcid | CR3_NOFLUSH);
+            return;
+        }
+    }
+
+    /* PCIDs are taken in turn, and the CR3 write drops the entries of the last owner */
+    size_t pcid = _pcid_next;
+    _pcid_next = pcid + 1 < VMM_PCID_COUNT ? pcid + 1 : 1;
+    _pcid_owners[pcid] = space;
+    _pcid_flushes++;
+    asm_write_cr3(space | pcid);
+}
+
+uintptr_t vmm_get_kernel_address_space()
+{
+    return _kernel_space;
+}
+
+uintptr_t vmm_get_current_address_space()
+{
+    return _current_space;
+}
+
+uintptr_t vmm_get_phys_in(uintptr_t space, uintptr_t virt)
+{
+    page_table_entry_t *entry = &_space_table(space)->entries[PML4_GET_INDEX(virt)];
+    for (int level = 2; level >= 0; level--) {
+        if (!entry->flags.present)
+            return 0;
+        page_table_t *table = vmm_get_hhdm_addr((void *) (entry->raw & PT_ADDR_MASK));
+        entry = &table->entries[PML_GET_INDEX(virt, level)];
+
+        /* The direct map uses 1 GiB and 2 MiB pages */
+        if (level > 0 && entry->flags.present && entry->flags.huge_page) {
+            uint64_t size = PML_ENTRY_SIZE(level);
+            return (entry->raw & PT_ADDR_MASK & ~(size - 1)) | (virt & (size - 1));
+        }
+    }
+    if (!entry->flags.present)
+        return 0;
+    return (entry->raw & PT_ADDR_MASK) | (virt & (PAGE_SIZE - 1));
+}
+
+uintptr_t vmm_get_phys(uintptr_t virt)
+{
+    return vmm_get_phys_in(_current_space, virt);
+}
+
+/*
+ * Maps pages consecutive pages from phys at virt, or unmaps them if map is false.
+ * The tables are walked down once, the entries of each page table are written in a
+ * row, and the walk only goes back up to the tables whose range was left.
+ * Returns the number of entries that were present before, whose old translation the
+ * TLB may still hold.
+ */
+static size_t _walk_range(
+    uintptr_t space,
+    uintptr_t virt,
+    uintptr_t phys,
+    size_t pages,
+    size_t flags,
+    bool map)
+{
+    page_table_t *tables[4] = {[3] = _space_table(space)};
+    size_t replaced = 0;
+    int level = 3;
+
+    flags = _leaf_flags(virt, flags);
+    while (pages > 0) {
+        /* Descend from the lowest table still covering virt to the page table */
+        for (; level > 0; level--) {
+            page_table_entry_t *entry = &tables[level]->entries[PML_GET_INDEX(virt, level)];
+            if (!map && !entry->flags.present)
+                break;
+            tables[level - 1] = _get_next_level(entry, level);
+            if (tables[level - 1] == NULL) {
+                debug_log_fmt("[-] Failed to map virtual address 0x%x\n", virt);
+                return replaced;
+            }
+        }
+
+        /* The rest of the page table, or the rest of the range of a missing entry */
+        uint64_t span = PML_ENTRY_SIZE(level == 0 ? 1 : level);
+        size_t count = (span - (virt & (span - 1))) / PAGE_SIZE;
+        if (count > pages)
+            count = pages;
+        if (level == 0) {
+            page_table_entry_t *entries = &tables[0]->entries[PML1_GET_INDEX(virt)];
+            for (size_t i = 0; i < count; i++) {
+                replaced += entries[i].flags.present;
+                entries[i].raw = map ? (phys + i * PAGE_SIZE) | flags : 0;
+            }
+        }
+
+        virt += count * PAGE_SIZE;
+        phys += count * PAGE_SIZE;
+        pages -= count;
+
+        /* Go back up past every table whose last entry was just passed */
+        if (level == 0)
+            level = 1;
+        while (level < 3 && PML_GET_INDEX(virt, level) == 0)
+            level++;
+    }
+    return replaced;
+}
+
+/*
+ * Invalidates the TLB entries of a range of an address space in one go: page by page
+ * for small ranges, with a CR3 write for the others.
+ */
+static void _flush_range(uintptr_t space, uintptr_t virt, size_t pages)
+{
+    if (virt < KERNEL_HALF_START && space != _current_space) {
+        /* Only the PCID of the address space may hold its user entries */
+        _pcid_release(space);
+        return;
+    }
+    if (pages <= VMM_INVLPG_MAX_PAGES) {
+        for (size_t i = 0; i < pages; i++)
+            asm_invlpg((void *) (virt + i * PAGE_SIZE));
+    } else if (virt >= KERNEL_HALF_START) {
+        _flush_all();
+    } else {
+        asm_write_cr3(asm_read_cr3());
+    }
+}
 
-    pt->entries[pt_index].raw = (uintptr_t) phys | flags;
+void vmm_map(uintptr_t virt, uintptr_t phys, size_t flags, bool flush)
+{
+    _walk_range(_current_space, virt, phys, 1, flags, true);
     if (flush) {
         debug_log_fmt("[*] Mapped phys 0x%x to virt 0x%x\n", phys, virt);
         asm_invlpg((void *) virt);
     }
-    return;
-
-failure:
-    debug_log_fmt("[-] Failed to map virtual address 0x%x to physical address 0x%x\n", virt, phys);
 }
 
-void vmm_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t size, size_t flags, bool flush)
+void vmm_map_range_in(
+    uintptr_t space,
+    uintptr_t virt_addr,
+    uintptr_t phys_addr,
+    size_t size,
+    size_t flags,
+    bool flush)
 {
     debug_log_fmt(
         "[*] Mapping 0x%x - 0x%x to 0x%x - 0x%x\n",
@@ -255,46 +714,61 @@ void vmm_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t size, size_t
         virt_addr,
         virt_addr + size);
     size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE; /* Round up */
-    for (size_t i = 0; i < num_pages; i++)
-        vmm_map(virt_addr + i * PAGE_SIZE, phys_addr + i * PAGE_SIZE, flags, false);
-    if (flush)
-        asm_write_cr3(asm_read_cr3());
+    size_t replaced = _walk_range(space, virt_addr, phys_addr, num_pages, flags, true);
+
+    /* Entries that were not present cannot be in the TLB */
+    if (flush && replaced > 0)
+        _flush_range(space, virt_addr, num_pages);
 }
 
-void vmm_unmap(uintptr_t virt, bool flush)
+void vmm_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t size, size_t flags, bool flush)
 {
-    uint64_t pml4_index = PML4_GET_INDEX(virt);
-    uint64_t pdpt_index = PML3_GET_INDEX(virt);
-    uint64_t pdt_index = PML2_GET_INDEX(virt);
-    uint64_t pt_index = PML1_GET_INDEX(virt);
+    vmm_map_range_in(_current_space, virt_addr, phys_addr, size, flags, flush);
+}
 
-    page_table_t *pdpt, *pdt, *pt;
+void vmm_unmap(uintptr_t virt, bool flush)
+{
+    if (_walk_range(_current_space, virt, 0, 1, 0, false) > 0 && flush)
+        asm_invlpg((void *) virt);
+}
 
-    pdpt = _get_next_level(&_pt_top_level->entries[pml4_index]);
-    if (pdpt == NULL)
-        goto failure;
+void vmm_unmap_range_in(uintptr_t space, uintptr_t virt_addr, size_t size, bool flush)
+{
+    debug_log_fmt("[*] Unmapping 0x%x - 0x%x\n", virt_addr, virt_addr + size);
+    size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE; /* Round up */
+    size_t cleared = _walk_range(space, virt_addr, 0, num_pages, 0, false);
+    if (flush && cleared > 0)
+        _flush_range(space, virt_addr, num_pages);
+}
 
-    pdt = _get_next_level(&pdpt->entries[pdpt_index]);
-    if (pdt == NULL)
-        goto failure;
-    pt = _get_next_level(&pdt->entries[pdt_index]);
-    if (pt == NULL)
-        goto failure;
+void vmm_unmap_range(uintptr_t virt_addr, size_t size, bool flush)
+{
+    vmm_unmap_range_in(_current_space, virt_addr, size, flush);
+}
 
-    pt->entries[pt_index].raw = 0;
-    if (flush)
-        asm_invlpg((void *) virt);
-    return;
+/*
+ * Unmaps a page-aligned range of the kernel image and gives its memory to the PMM.
+ */
+static void _free_kernel_range(uintptr_t start_vaddr, uintptr_t end_vaddr)
+{
+    if (end_vaddr <= start_vaddr)
+        return;
 
-failure:
-    debug_log_fmt("[-] Failed to unmap virtual address 0x%x\n", virt);
+    uintptr_t start_paddr = start_vaddr - _kernel_vaddr + _kernel_paddr;
+    vmm_unmap_range(start_vaddr, end_vaddr - start_vaddr, true);
+    pmm_add_range(start_paddr, end_vaddr - start_vaddr);
 }
 
-void vmm_unmap_range(uintptr_t virt_addr, size_t size, bool flush)
+void vmm_free_init_sections()
 {
-    debug_log_fmt("[*] Unmapping 0x%x - 0x%x\n", virt_addr, virt_addr + size);
-    size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE; /* Round up */
-    for (size_t i = 0; i < num_pages; i++) {
-        vmm_unmap(virt_addr + i * PAGE_SIZE, flush);
-    }
+    uintptr_t init_text_start = (uintptr_t) &_init_text_start;
+    uintptr_t init_text_end = (uintptr_t) &_init_text_end;
+    uintptr_t init_data_start = (uintptr_t) &_init_data_start;
+    uintptr_t init_data_end = (uintptr_t) &_init_data_end;
+
+    debug_log_fmt(
+        "[*] Freeing %d KB of init sections\n",
+        (init_text_end - init_text_start + init_data_end - init_data_start) / 1024);
+    _free_kernel_range(init_text_start, init_text_end);
+    _free_kernel_range(init_data_start, init_data_end);
 }
@@ -7,6 +7,7 @@
 #include <kernel/fs/initrdfs.h>
 #include <kernel/fs/ustar.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/init.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/klibc/string.h>
 #include <kernel/memory/heap.h>
@@ -300,6 +301,7 @@ vfs_drive_t *initrd_new_drive(const char *prefix, void *data)
         return NULL;
 
     new_drive->internal = data;
+    new_drive->read_only = true;
     new_drive->open = _initrd_open;
     new_drive->create = _initrd_create;
     new_drive->remove = _initrd_remove;
@@ -312,7 +314,7 @@ vfs_drive_t *initrd_new_drive(const char *prefix, void *data)
     return new_drive;
 }
 
-void initrd_load_modules(struct limine_module_response *response)
+void __init initrd_load_modules(struct limine_module_response *response)
 {
     debug_log("[*] Loading kernel modules...\n");
     for (uint64_t i = 0; i < response->module_count; i++) {
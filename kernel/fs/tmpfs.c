@@ -6,7 +6,9 @@
 #include <kernel/fs/vfs.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/klibc/string.h>
+#include <kernel/memory/arena.h>
 #include <kernel/memory/heap.h>
+#include <kernel/memory/slab.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -16,24 +18,40 @@ typedef struct
     void *data;
 } _tmpfs_inode_t;
 
+static kmem_cache_t *_node_cache;
+static kmem_cache_t *_inode_cache;
+
+static void _tmpfs_inode_init(void *object)
+{
+    _tmpfs_inode_t *inode = object;
+    inode->data = NULL;
+    inode->size = 0;
+}
+
 static vfs_node_t *_new_tmpfs_node(file_type_t type)
 {
-    vfs_node_t *new_node = kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *new_node = kmem_cache_alloc(_node_cache);
     if (new_node == NULL)
         return NULL;
     new_node->name = NULL;
     new_node->type = type;
-    new_node->internal = kmalloc(sizeof(_tmpfs_inode_t));
+    new_node->internal = kmem_cache_alloc(_inode_cache);
     if (new_node->internal == NULL) {
-        kfree(new_node);
+        kmem_cache_free(_node_cache, new_node);
         return NULL;
     }
-    _tmpfs_inode_t *inode = new_node->internal;
-    inode->data = NULL;
-    inode->size = 0;
     return new_node;
 }
 
+static void _free_tmpfs_node(vfs_node_t *node)
+{
+    _tmpfs_inode_t *inode = node->internal;
+    kfree(inode->data);
+    kmem_cache_free(_inode_cache, inode);
+    kfree(node->name);
+    kmem_cache_free(_node_cache, node);
+}
+
 static int _tmpfs_create(struct vfs_drive *drive, const char *name, file_type_t type)
 {
     if (strcmp(name, "/") == 0)
@@ -41,38 +59,29 @@ static int _tmpfs_create(struct vfs_drive *drive, const char *name, file_type_t
 
     /* Find last slash to separate parent path and child name */
     const char *last_slash = strrchr(name, '/');
-    const char *child_name;
-    char *parent_path = NULL;
+    const char *child_name = last_slash != NULL ? last_slash + 1 : name;
+
+    /* Check if child name is empty (path ends with slash) */
+    if (last_slash != NULL && *child_name == '\0')
+        return -1;
 
+    /* The parent path is only needed for the lookup */
+    arena_mark_t scratch = arena_begin();
+    char *parent_path;
     if (last_slash == NULL) {
         /* No slash: parent is root, child name is whole string */
-        child_name = name;
-        parent_path = strdup("");
-        if (parent_path == NULL)
-            return -1;
+        parent_path = arena_strndup("", 0);
+    } else if (last_slash == name) {
+        /* Parent is root (path like "/file") */
+        parent_path = arena_strndup("/", 1);
     } else {
-        child_name = last_slash + 1;
-        /* Check if child name is empty (path ends with slash) */
-        if (*child_name == '\0')
-            return -1;
-
-        size_t parent_len = last_slash - name;
-        if (parent_len == 0) {
-            /* Parent is root (path like "/file") */
-            parent_path = strdup("/");
-            if (parent_path == NULL)
-                return -1;
-        } else {
-            parent_path = kmalloc(parent_len + 1);
-            if (parent_path == NULL)
-                return -1;
-            memcpy(parent_path, name, parent_len);
-            parent_path[parent_len] = '\0';
-        }
+        parent_path = arena_strndup(name, last_slash - name);
     }
 
-    vfs_node_t *parent = vfs_get_relative_path(((vfs_drive_t *) drive)->internal, parent_path);
-    kfree(parent_path);
+    vfs_node_t *parent = NULL;
+    if (parent_path != NULL)
+        parent = vfs_get_relative_path(((vfs_drive_t *) drive)->internal, parent_path);
+    arena_end(scratch);
 
     if (!parent || parent->type != DIRECTORY) {
         return -1;
@@ -84,8 +93,7 @@ static int _tmpfs_create(struct vfs_drive *drive, const char *name, file_type_t
 
     new_node->name = strdup(child_name);
     if (new_node->name == NULL) {
-        kfree(new_node->internal);
-        kfree(new_node);
+        _free_tmpfs_node(new_node);
         return -1;
     }
 
@@ -159,11 +167,8 @@ static int _tmpfs_remove(struct vfs_drive *drive, const char *name)
     if (!file)
         return -1;
 
-    kfree(((_tmpfs_inode_t *) file->internal)->data);
-    kfree(file->internal);
-    kfree(file->name);
-    kfree(file);
     vfs_remove_child(file->parent, file);
+    _free_tmpfs_node(file);
 
     return 0;
 }
@@ -259,6 +264,14 @@ static size_t _tmpfs_tell(file_t *file)
 
 vfs_drive_t *tmpfs_new_drive(const char *name)
 {
+    if (_node_cache == NULL) {
+        _node_cache = kmem_cache_create("vfs_node", sizeof(vfs_node_t), 0, NULL);
+        _inode_cache = kmem_cache_create(
+            "tmpfs_inode", sizeof(_tmpfs_inode_t), 0, _tmpfs_inode_init);
+        if (_node_cache == NULL || _inode_cache == NULL)
+            return NULL;
+    }
+
     vfs_drive_t *drive = vfs_new_drive(name);
     if (drive == NULL)
         return NULL;
@@ -6,6 +6,7 @@
 #include <kernel/fs/vfs.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/klibc/string.h>
+#include <kernel/memory/arena.h>
 #include <kernel/memory/heap.h>
 #include <stdint.h>
 
@@ -66,6 +67,7 @@ vfs_drive_t *vfs_new_drive(const char *name)
     if (!drive)
         return NULL;
     drive->id = index;
+    drive->read_only = false;
 
     /* Copy the unique name we constructed */
     strncpy(drive->name, final_name, sizeof(drive->name) - 1);
@@ -123,7 +125,6 @@ void vfs_remove_child(vfs_node_t *parent, vfs_node_t *child)
                 prev->sibling = current->sibling;
             else
                 parent->child = current->sibling;
-            kfree(current);
             return;
         }
         prev = current;
@@ -223,7 +224,13 @@ static int _get_path(const char *full_path, vfs_drive_t **drive, char *path, siz
     /* Skip drive name part (name:/) */
     full_path = colon_pos + 2;
 
-    char temp[buffer_size];
+    arena_mark_t scratch = arena_begin();
+    char *temp = arena_alloc(buffer_size);
+    if (temp == NULL) {
+        arena_end(scratch);
+        return -1;
+    }
+    temp[0] = '\0';
     size_t pos = 0;
 
     /* Process each component of the path */
@@ -253,8 +260,10 @@ static int _get_path(const char *full_path, vfs_drive_t **drive, char *path, siz
             }
         } else {
             /* Regular component, append it */
-            if (pos + component_len + 1 >= buffer_size)
+            if (pos + component_len + 1 >= buffer_size) {
+                arena_end(scratch);
                 return -1; // Buffer too small
+            }
 
             if (pos > 1 || temp[0] != '/') // Don't add slash if we're at root
                 temp[pos++] = '/';
@@ -274,39 +283,55 @@ static int _get_path(const char *full_path, vfs_drive_t **drive, char *path, siz
     }
 
     /* Copy result to output buffer */
-    if (strlen(temp) >= buffer_size)
-        return -1;
-
-    strcpy(path, temp);
+    int result = -1;
+    if (strlen(temp) < buffer_size) {
+        strcpy(path, temp);
+        result = 0;
+    }
+    arena_end(scratch);
+    return result;
+}
 
-    return 0;
+/*
+ * Resolves a full path into a scratch buffer of the current arena scope.
+ * Returns the path within its drive, or NULL if it cannot be resolved.
+ */
+static char *_get_scratch_path(const char *full_path, vfs_drive_t **drive)
+{
+    char *path = arena_alloc(PATH_MAX);
+    if (path == NULL || _get_path(full_path, drive, path, PATH_MAX) < 0)
+        return NULL;
+    return path;
 }
 
 file_t file_open(const char *full_path)
 {
     vfs_drive_t *drive = NULL;
-    char path[PATH_MAX];
-    if (_get_path(full_path, &drive, path, sizeof(path)) < 0)
-        return (file_t) {0};
-    return drive->open((struct vfs_drive *) drive, path);
+    arena_mark_t scratch = arena_begin();
+    char *path = _get_scratch_path(full_path, &drive);
+    file_t file = path != NULL ? drive->open((struct vfs_drive *) drive, path) : (file_t) {0};
+    arena_end(scratch);
+    return file;
 }
 
 int file_create(const char *full_path, file_type_t type)
 {
     vfs_drive_t *drive = NULL;
-    char path[PATH_MAX];
-    if (_get_path(full_path, &drive, path, sizeof(path)) < 0)
-        return -1;
-    return drive->create((struct vfs_drive *) drive, path, type);
+    arena_mark_t scratch = arena_begin();
+    char *path = _get_scratch_path(full_path, &drive);
+    int result = path != NULL ? drive->create((struct vfs_drive *) drive, path, type) : -1;
+    arena_end(scratch);
+    return result;
 }
 
 int file_remove(const char *full_path)
 {
     vfs_drive_t *drive = NULL;
-    char path[PATH_MAX];
-    if (_get_path(full_path, &drive, path, sizeof(path)) < 0)
-        return -1;
-    return drive->remove((struct vfs_drive *) drive, path);
+    arena_mark_t scratch = arena_begin();
+    char *path = _get_scratch_path(full_path, &drive);
+    int result = path != NULL ? drive->remove((struct vfs_drive *) drive, path) : -1;
+    arena_end(scratch);
+    return result;
 }
 
 int file_read(file_t *file, void *buffer, uint32_t size)
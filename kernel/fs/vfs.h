@@ -72,6 +72,7 @@ typedef struct vfs_drive
     uint8_t id;     /* Drive index (0-255) */
     char name[40];  /* Drive name */
     void *internal; /* Internal drive data */
+    bool read_only; /* Files never change and stay readable for as long as the drive exists */
     file_t (*open)(struct vfs_drive *drive, const char *path);
     int (*create)(struct vfs_drive *drive, const char *name, file_type_t type);
     int (*remove)(struct vfs_drive *drive, const char *name);
@@ -104,7 +105,7 @@ void vfs_remove_drive_by_name(const char *name);
  */
 void vfs_add_child(vfs_node_t *parent, vfs_node_t *child);
 /*
- * Remove a child node from a parent node.
+ * Remove a child node from a parent node. The node itself is not freed.
  */
 void vfs_remove_child(vfs_node_t *parent, vfs_node_t *child);
 
@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+/*
+ * Places boot-only code and data in the init sections of the kernel image.
+ * These sections are freed right before the terminal starts, so nothing marked
+ * this way may be called or accessed once the kernel is initialized.
+ */
+#define __init __attribute__((section(".init.text")))
+#define __initdata __attribute__((section(".init.data")))
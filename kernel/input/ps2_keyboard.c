@@ -5,6 +5,7 @@
 
 #include <kernel/arch/pc/asm.h>
 #include <kernel/arch/pc/idt.h>
+#include <kernel/init.h>
 #include <kernel/input/ps2_keyboard.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/memory/heap.h>
@@ -86,7 +87,7 @@ static void _ps2_irq()
     }
 }
 
-void ps2_init_keyboard()
+void __init ps2_init_keyboard()
 {
     while (asm_inb(PS2_STATUS_PORT) & 0x01)
         asm_inb(PS2_DATA_PORT);
@@ -6,6 +6,7 @@
 #include <kernel/arch/pc/asm.h>
 #include <kernel/arch/pc/idt.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/input/ps2_mouse.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/memory/heap.h>
@@ -83,7 +84,7 @@ static uint8_t _mouse_read()
     return asm_inb(PS2_DATA_PORT);
 }
 
-void ps2_mouse_init()
+void __init ps2_mouse_init()
 {
     /* Mouse initialization sequence */
     asm_outb(0xA8, PS2_COMMAND_PORT);
@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include <kernel/arch/pc/acpi.h>
 #include <kernel/arch/pc/gdt.h>
 #include <kernel/arch/pc/idt.h>
 #include <kernel/arch/pc/sse.h>
@@ -10,14 +11,18 @@
 #include <kernel/fs/initrdfs.h>
 #include <kernel/fs/tmpfs.h>
 #include <kernel/fs/vfs.h>
+#include <kernel/init.h>
 #include <kernel/input/ps2_keyboard.h>
 #include <kernel/input/ps2_mouse.h>
 #include <kernel/memory/heap.h>
+#include <kernel/memory/numa.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/memory/vmalloc.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/serial.h>
 #include <kernel/terminal/terminal.h>
 #include <kernel/timer.h>
+#include <kernel/usermode/fault.h>
 #include <kernel/usermode/syscall.h>
 #include <kernel/usermode/task.h>
 #include <libs/flanterm/src/flanterm_backends/fb.h>
@@ -43,6 +48,26 @@ __attribute__((used, section(".limine_requests_end"))) static volatile LIMINE_RE
 
 struct flanterm_context *_fb_ctx;
 
+/* Copy of the first framebuffer, the bootloader response does not outlive boot */
+struct limine_framebuffer boot_framebuffer;
+
+/*
+ * Copies the bootloader responses still needed once bootloader memory is reclaimed.
+ */
+static void __init _copy_boot_info()
+{
+    vmm_early_init();
+
+    struct limine_framebuffer_response *fb_response = framebuffer_request.response;
+    if (fb_response != NULL && fb_response->framebuffer_count > 0) {
+        boot_framebuffer = *fb_response->framebuffers[0];
+        boot_framebuffer.edid = NULL;
+        boot_framebuffer.edid_size = 0;
+        boot_framebuffer.modes = NULL;
+        boot_framebuffer.mode_count = 0;
+    }
+}
+
 void kmain()
 {
     if (!LIMINE_BASE_REVISION_SUPPORTED) {
@@ -50,6 +75,7 @@ void kmain()
             __asm__("hlt");
     }
     sse_init();
+    _copy_boot_info();
 
     start_debug_serial(SERIAL_COM1);
     start_debug_console(framebuffer_request.response);
@@ -58,19 +84,31 @@ void kmain()
     idt_init();
     pmm_init(limine_mmap_request.response);
     vmm_init(limine_mmap_request.response);
+    acpi_init();
+    numa_init();
+    pmm_numa_init();
     heap_init(10);
+    vmalloc_init();
     timer_init();
     syscalls_init();
     task_switching_init();
+    page_fault_init();
     initrd_load_modules(limine_module_request.response);
     tmpfs_new_drive("tmpfs");
 
     ps2_init_keyboard();
     ps2_mouse_init();
 
+    /* Nothing from the bootloader or the init sections is used past this point */
+    pmm_reclaim(limine_mmap_request.response);
+    vmm_free_init_sections();
+
     stop_debug_console();
-    term_init(framebuffer_request.response);
+    term_init(&boot_framebuffer);
 
-    while (1)
+    while (1) {
+        pmm_idle();
+        vmalloc_idle();
         __asm__("hlt");
+    }
 }
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/klibc/memory.h>
+#include <kernel/memory/arena.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/vmm.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT 16
+
+/*
+ * Header at the start of every backing chunk. Chunks are direct-mapped runs of pages.
+ */
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size; /* Bytes in the chunk, header included */
+};
+
+#define ARENA_CHUNK_HEADER                                                                         \
+    ((sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+
+/*
+ * Scratch arena of one CPU. Chunks stay linked after their scope ends, so that the
+ * next scopes reuse them without going back to the PMM.
+ */
+typedef struct
+{
+    arena_chunk_t *first;
+    arena_chunk_t *current; /* Chunk the next allocation is bumped from */
+    size_t offset;          /* Offset of the next allocation in the current chunk */
+    size_t depth;           /* Open scopes */
+} cpu_arena_t;
+
+static cpu_arena_t _arenas[MAX_CPUS];
+
+static arena_chunk_t *_new_chunk(size_t size)
+{
+    size_t pages = PAGE_UP(size + ARENA_CHUNK_HEADER) / PAGE_SIZE;
+    if (pages < ARENA_CHUNK_PAGES)
+        pages = ARENA_CHUNK_PAGES;
+
+    void *memory = pmm_alloc(pages);
+    if (memory == NULL)
+        return NULL;
+
+    arena_chunk_t *chunk = vmm_get_hhdm_addr(memory);
+    chunk->next = NULL;
+    chunk->size = pages * PAGE_SIZE;
+    return chunk;
+}
+
+static void _free_chunk(arena_chunk_t *chunk)
+{
+    pmm_free(vmm_get_lhdm_addr(chunk), chunk->size / PAGE_SIZE);
+}
+
+arena_mark_t arena_begin()
+{
+    cpu_arena_t *arena = &_arenas[cpu_get_id()];
+    arena->depth++;
+    return (arena_mark_t) {.chunk = arena->current, .offset = arena->offset};
+}
+
+void *arena_alloc(size_t size)
+{
+    cpu_arena_t *arena = &_arenas[cpu_get_id()];
+    if (arena->depth == 0) {
+        debug_log("[!] arena_alloc: No arena scope is open\n");
+        return NULL;
+    }
+    if (size > SIZE_MAX - PAGE_SIZE - ARENA_CHUNK_HEADER)
+        return NULL;
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+    arena_chunk_t *chunk = arena->current;
+    if (chunk == NULL || arena->offset + size > chunk->size) {
+        /* Move on to the next chunk, or put a new one in front of it if it is too small */
+        arena_chunk_t *next = chunk != NULL ? chunk->next : arena->first;
+        if (next == NULL || ARENA_CHUNK_HEADER + size > next->size) {
+            arena_chunk_t *new_chunk = _new_chunk(size);
+            if (new_chunk == NULL) {
+                debug_log_fmt("[-] arena_alloc failed: Could not back %d bytes\n", size);
+                return NULL;
+            }
+            new_chunk->next = next;
+            if (chunk != NULL)
+                chunk->next = new_chunk;
+            else
+                arena->first = new_chunk;
+            next = new_chunk;
+        }
+        arena->current = next;
+        arena->offset = ARENA_CHUNK_HEADER;
+        chunk = next;
+    }
+
+    void *pointer = (uint8_t *) chunk + arena->offset;
+    arena->offset += size;
+    return pointer;
+}
+
+char *arena_strndup(const char *str, size_t length)
+{
+    char *copy = arena_alloc(length + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+void arena_end(arena_mark_t mark)
+{
+    cpu_arena_t *arena = &_arenas[cpu_get_id()];
+    if (arena->depth == 0) {
+        debug_log("[!] arena_end: No arena scope is open\n");
+        return;
+    }
+
+    arena->current = mark.chunk;
+    arena->offset = mark.offset;
+    if (--arena->depth > 0 || arena->first == NULL)
+        return;
+
+    /* Keep a single chunk of the default size for the next scopes */
+    arena_chunk_t *keep = arena->first;
+    arena_chunk_t *chunk = keep->next;
+    if (keep->size != ARENA_CHUNK_PAGES * PAGE_SIZE) {
+        chunk = keep;
+        keep = NULL;
+    }
+    while (chunk != NULL) {
+        arena_chunk_t *next = chunk->next;
+        _free_chunk(chunk);
+        chunk = next;
+    }
+    if (keep != NULL)
+        keep->next = NULL;
+    arena->first = keep;
+    arena->current = NULL;
+    arena->offset = 0;
+}
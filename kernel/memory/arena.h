@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Number of pages in each backing chunk of a CPU arena. Bigger requests get a chunk
+ * of their own.
+ */
+#define ARENA_CHUNK_PAGES 4
+
+typedef struct arena_chunk arena_chunk_t;
+
+/*
+ * Position in the arena of the current CPU, returned by arena_begin.
+ */
+typedef struct
+{
+    arena_chunk_t *chunk;
+    size_t offset;
+} arena_mark_t;
+
+/*
+ * Open a scope in the scratch arena of the current CPU. Everything allocated with
+ * arena_alloc until the matching arena_end is released at once by arena_end.
+ * Scopes nest, must be closed in the reverse order they were opened, and must not
+ * span a task switch. The arena cannot be used from interrupt handlers.
+ */
+arena_mark_t arena_begin();
+
+/*
+ * Allocate 16-byte aligned scratch memory in the innermost open scope.
+ * Returns a pointer to the memory, or NULL if no scope is open or no memory is left.
+ */
+void *arena_alloc(size_t size);
+
+/*
+ * Copy the first length characters of a string into the innermost open scope and
+ * terminate the copy.
+ * Returns the copy, or NULL if the allocation fails.
+ */
+char *arena_strndup(const char *str, size_t length);
+
+/*
+ * Close a scope, releasing everything allocated since the matching arena_begin.
+ * Chunks grown past the first one go back to the PMM once no scope is open.
+ */
+void arena_end(arena_mark_t mark);
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/debug.h>
+#include <kernel/klibc/memory.h>
+#include <kernel/memory/compact.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/vmm.h>
+#include <kernel/usermode/task.h>
+
+/* Allocations made while migrating must not start another pass */
+static bool _compacting = false;
+
+/*
+ * Returns the user memory block holding a physical address and stores the task
+ * mapping it, or returns NULL if no task maps it.
+ */
+static task_memblock_t *_find_memblock(uintptr_t phys, task_t **owner)
+{
+    task_t *head = task_idle();
+    for (task_t *task = task_next(head); task != head; task = task_next(task)) {
+        for (size_t i = 0; i < task->memory.memblocks_count; i++) {
+            task_memblock_t *memblock = &task->memory.memblocks[i];
+            if (!(memblock->flags & PTFLAG_US))
+                continue;
+            if (phys >= memblock->phys_addr
+                && phys < memblock->phys_addr + memblock->page_count * PAGE_SIZE) {
+                *owner = task;
+                return memblock;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns true if the pages of a memory block can be moved to another place.
+ */
+static bool _is_movable(task_t *task, task_memblock_t *memblock)
+{
+    for (size_t i = 0; i < memblock->page_count; i++) {
+        uintptr_t phys = memblock->phys_addr + i * PAGE_SIZE;
+        page_t *page = page_lookup(phys);
+
+        /* Pages referenced by anything else than this mapping stay where they are */
+        if (page == NULL || page->refcount != 1 || page->flags & PAGE_FLAG_PINNED)
+            return false;
+
+        /* The page may have been mapped over since */
+        if (vmm_get_phys_in(task->state.cr3, memblock->virt_addr + i * PAGE_SIZE) != phys)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Returns the number of pages to move to free the block of the given order at base,
+ * or -1 if the block holds pages that cannot move or free pages the allocator does not
+ * own, like reserved huge frames.
+ */
+static long _block_cost(uintptr_t base, int order)
+{
+    size_t pages = (size_t) 1 << order;
+    long cost = 0;
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t phys = base + i * PAGE_SIZE;
+        page_t *page = page_lookup(phys);
+        if (page == NULL)
+            return -1;
+        if (page->refcount == 0) {
+            if (!pmm_is_free(phys))
+                return -1;
+            i++;
+            continue;
+        }
+
+        task_t *task;
+        task_memblock_t *memblock = _find_memblock(phys, &task);
+        if (memblock == NULL || !_is_movable(task, memblock))
+            return -1;
+
+        /* The whole memory block moves, skip the rest of it */
+        cost += memblock->page_count;
+        i = PHYS_TO_FRAME(memblock->phys_addr) + memblock->page_count - PHYS_TO_FRAME(base);
+    }
+    return cost;
+}
+
+/*
+ * Copies a memory block to newly allocated pages and maps it there.
+ * Returns true if successful, false if no room was found for it.
+ */
+static bool _migrate_memblock(task_t *task, task_memblock_t *memblock)
+{
+    size_t size = memblock->page_count * PAGE_SIZE;
+    void *new_phys = pmm_alloc(memblock->page_count);
+    if (new_phys == NULL)
+        return false;
+
+    memcpy(vmm_get_hhdm_addr(new_phys), vmm_get_hhdm_addr((void *) memblock->phys_addr), size);
+
+    /* The mapping takes over the allocation reference */
+    page_get((uintptr_t) new_phys, memblock->page_count, true);
+    pmm_free(new_phys, memblock->page_count);
+    vmm_map_range_in(
+        task->state.cr3, memblock->virt_addr, (uintptr_t) new_phys, size, memblock->flags, true);
+    page_put(memblock->phys_addr, memblock->page_count, true);
+    memblock->phys_addr = (uintptr_t) new_phys;
+    return true;
+}
+
+/*
+ * Moves every used page out of the block of the given order at base.
+ * Returns true if the block was emptied.
+ */
+static bool _evacuate_block(uintptr_t base, int order)
+{
+    size_t pages = (size_t) 1 << order;
+    bool success = true;
+
+    /* Keep the allocator from handing out pages of the block while it is emptied */
+    pmm_isolate_range(base, pages);
+    for (size_t i = 0; i < pages && success; i++) {
+        uintptr_t phys = base + i * PAGE_SIZE;
+        if (page_lookup(phys)->refcount == 0)
+            continue;
+        task_t *task;
+        task_memblock_t *memblock = _find_memblock(phys, &task);
+        success = memblock != NULL && _migrate_memblock(task, memblock);
+    }
+    pmm_release_isolated(base, pages);
+    return success;
+}
+
+size_t compact_memory(int order, size_t max_blocks)
+{
+    if (_compacting || order <= 0 || order > PMM_MAX_ORDER)
+        return 0;
+    _compacting = true;
+
+    debug_log_fmt(
+        "[*] Compacting memory for order %d (fragmentation index: %d)\n",
+        order,
+        pmm_fragmentation_index(order));
+
+    size_t block_size = (size_t) PAGE_SIZE << order;
+    size_t evacuated = 0;
+    while (evacuated < max_blocks) {
+        uintptr_t best_base = 0;
+        long best_cost = -1;
+
+        size_t region_count;
+        const pmm_region_t *regions = pmm_get_regions(&region_count);
+        for (size_t i = 0; i < region_count; i++) {
+            uintptr_t region_end = regions[i].base + regions[i].page_count * PAGE_SIZE;
+            uintptr_t base = (regions[i].base + block_size - 1) & ~(block_size - 1);
+            for (; base + block_size <= region_end; base += block_size) {
+                long cost = _block_cost(base, order);
+                if (cost > 0 && (best_cost < 0 || cost < best_cost)) {
+                    best_base = base;
+                    best_cost = cost;
+                }
+            }
+        }
+
+        if (best_cost < 0 || !_evacuate_block(best_base, order))
+            break;
+        debug_log_fmt("[*]\tEvacuated 0x%x (%d pages moved)\n", best_base, best_cost);
+        evacuated++;
+    }
+
+    debug_log_fmt(
+        "[+] Compaction rebuilt %d blocks (fragmentation index: %d)\n",
+        evacuated,
+        pmm_fragmentation_index(order));
+    _compacting = false;
+    return evacuated;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Maximum number of blocks rebuilt by a compaction pass started from the shell.
+ */
+#define COMPACT_MAX_BLOCKS 16
+
+/*
+ * Migrate the pages of user tasks out of the way to rebuild free blocks of the given
+ * order, evacuating at most max_blocks blocks. Blocks needing the fewest pages moved
+ * are evacuated first.
+ * Returns the number of blocks that were evacuated.
+ */
+size_t compact_memory(int order, size_t max_blocks);
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/debug.h>
+#include <kernel/memory/dma.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/vmm.h>
+
+void *dma_alloc(size_t size, uintptr_t max_phys, size_t align, uintptr_t *phys)
+{
+    if (size == 0 || size > SIZE_MAX - PAGE_SIZE)
+        return NULL;
+    if (align < PAGE_SIZE)
+        align = PAGE_SIZE;
+
+    void *memory = pmm_alloc_constrained(PAGE_UP(size) / PAGE_SIZE, max_phys, align);
+    if (memory == NULL) {
+        debug_log_fmt("[-] dma_alloc failed: %d bytes below 0x%x\n", size, max_phys);
+        return NULL;
+    }
+
+    if (phys != NULL)
+        *phys = (uintptr_t) memory;
+    return vmm_get_hhdm_addr(memory);
+}
+
+void dma_free(void *buffer, size_t size)
+{
+    if (buffer == NULL)
+        return;
+    pmm_free(vmm_get_lhdm_addr(buffer), PAGE_UP(size) / PAGE_SIZE);
+}
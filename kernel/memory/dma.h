@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Highest physical address reachable by devices limited to 32-bit addresses.
+ */
+#define DMA_MAX_PHYS_32 0xFFFFFFFFULL
+
+/*
+ * Highest physical address, for devices that can reach all of memory.
+ */
+#define DMA_MAX_PHYS_ANY UINTPTR_MAX
+
+/*
+ * Allocate a physically contiguous buffer for a device. The buffer ends at or below
+ * max_phys, starts on an align boundary (a power of two, page alignment at least)
+ * and is rounded up to whole pages. Its physical address is stored in phys.
+ * Returns the address of the buffer in the direct map, or NULL if no such memory
+ * is left.
+ */
+void *dma_alloc(size_t size, uintptr_t max_phys, size_t align, uintptr_t *phys);
+
+/*
+ * Free a buffer returned by dma_alloc, given the size it was allocated with.
+ * Does nothing if the buffer is NULL.
+ */
+void dma_free(void *buffer, size_t size);
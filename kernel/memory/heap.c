@@ -3,192 +3,994 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include <kernel/arch/pc/cpu.h>
+#include <kernel/arch/pc/idt.h>
+#include <kernel/arch/pc/spinlock.h>
+#include <kernel/init.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/memory/heap.h>
+#include <kernel/memory/heapprof.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/memory/vmalloc.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/debug.h>
 #include <stdint.h>
 
-typedef struct block_header
+/*
+ * Payloads are aligned to 16 bytes, so block sizes are multiples of 16.
+ */
+#define HEAP_ALIGNMENT 16
+
+/*
+ * Set in the size of a block that is handed out.
+ */
+#define BLOCK_USED 1
+
+/*
+ * Stored in every block header to catch frees of pointers kmalloc never returned.
+ * The low byte of the magic of a used block holds the CPU that took it from the
+ * heap, whose cache the block goes back to, and the next two bytes hold its
+ * allocation profiler site. Blocks sitting in a CPU cache carry BLOCK_CACHED
+ * instead, so that freeing them twice is caught too.
+ */
+#define BLOCK_MAGIC 0x4B48454100000000ULL
+#define BLOCK_CACHED 0x4B48454300000000ULL
+#define BLOCK_OWNER_MASK 0xFFULL
+#define BLOCK_SITE_SHIFT 8
+#define BLOCK_SITE_MASK 0xFFFF00ULL
+
+/*
+ * Free blocks are sorted into one list per power of two of their size, from 32 bytes
+ * up. Only the first blocks of the matching list are tried before moving on to a
+ * larger list, where every block fits.
+ */
+#define HEAP_CLASS_COUNT 32
+#define HEAP_CLASS_SHIFT 5
+#define HEAP_CLASS_SCAN 8
+
+/*
+ * Every block starts with a header and ends with a footer holding its size, so that
+ * both neighbours of a block are found in constant time.
+ */
+typedef struct
 {
-    size_t size;
-    struct block_header *next;
+    size_t size; /* Size of the whole block, tags included, ORed with BLOCK_USED */
+    size_t magic;
 } block_header_t;
 
+typedef size_t block_footer_t;
+
+/*
+ * Free blocks keep the links of their size class list after the header.
+ */
+typedef struct free_block
+{
+    block_header_t header;
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+#define BLOCK_OVERHEAD (sizeof(block_header_t) + sizeof(block_footer_t))
+#define BLOCK_MIN_SIZE                                                                             \
+    ((sizeof(free_block_t) + sizeof(block_footer_t) + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1))
+
+/*
+ * Every chunk of pages given to the heap is fenced by a used footer at its start and
+ * a used, empty header at its end, so that coalescing stops at the chunk edges.
+ */
+#define CHUNK_OVERHEAD (2 * sizeof(block_header_t))
+
+/*
+ * Whole free pages go back to the PMM once the heap holds more than the high mark of
+ * free memory, and the heap keeps the low mark for itself. The gap keeps bursts of
+ * small allocations and frees from moving the same pages back and forth.
+ */
+#define HEAP_RELEASE_HIGH_PAGES 64
+#define HEAP_RELEASE_LOW_PAGES 16
+
+/*
+ * Small blocks freed on a CPU are kept by that CPU, one cache per power of two of
+ * their payload size from 16 to 512 bytes, and handed out again without taking the
+ * heap lock. Caches are refilled from and flushed to the heap in batches.
+ */
+#define HEAP_CACHE_CLASSES 6
+#define HEAP_CACHE_MIN_SHIFT 4
+#define HEAP_CACHE_SIZE 32
+#define HEAP_CACHE_BATCH 16
+
+/*
+ * Blocks of each cache class that every CPU keeps aside for atomic allocations, which
+ * never grow the heap. The reserve is topped up when a magazine is refilled outside
+ * of atomic context.
+ */
+#define HEAP_RESERVE_SIZE 8
+
+typedef struct
+{
+    size_t count;
+    void *objects[HEAP_CACHE_SIZE];
+} heap_magazine_t;
+
+/*
+ * Blocks cached by one CPU. Only that CPU touches its magazines, with interrupts
+ * disabled. Other CPUs push the blocks they free onto the remote list, which the
+ * owner takes as a whole when one of its magazines runs dry.
+ */
+typedef struct
+{
+    heap_magazine_t magazines[HEAP_CACHE_CLASSES];
+    size_t cached_memory; /* Payload bytes held in the magazines */
+    size_t hits;          /* kmalloc calls served by a magazine */
+    void *remote_frees;   /* Linked through the first word of the payload */
+    size_t remote_count;
+    size_t remote_memory;
+    void *reserve[HEAP_CACHE_CLASSES][HEAP_RESERVE_SIZE];
+    size_t reserve_count[HEAP_CACHE_CLASSES];
+} heap_cpu_cache_t;
+
 static size_t _free_blocks = 0;
 static size_t _used_blocks = 0;
 static size_t _used_memory = 0;
+static size_t _inplace_reallocs = 0;
+static size_t _copied_reallocs = 0;
+static size_t _released_pages = 0;
+static size_t _remote_frees = 0;
+static size_t _atomic_failures = 0;
+static size_t _irq_violations = 0;
+static size_t _profiled_areas = 0; /* Live vmalloc blocks carrying a profiler site */
+
+static heap_cpu_cache_t _cpu_caches[MAX_CPUS];
+static spinlock_t _heap_lock;
 
 static struct
 {
-    void *start;
     size_t total_size;
-    block_header_t *free_list;
+    size_t free_size; /* Bytes held in free blocks */
+    free_block_t *free_lists[HEAP_CLASS_COUNT];
+    uint32_t class_map; /* Bit n is set when free_lists[n] is not empty */
 } _heap;
 
-static void _add_free_block(void *memory, size_t size)
+static inline size_t _block_size(void *block)
 {
-    block_header_t *new_block = (block_header_t *) memory;
-    new_block->size = size - sizeof(block_header_t);
-    new_block->next = NULL;
+    return ((block_header_t *) block)->size & ~(size_t) BLOCK_USED;
+}
+
+static inline bool _block_used(void *block)
+{
+    return ((block_header_t *) block)->size & BLOCK_USED;
+}
+
+static inline block_footer_t *_block_footer(void *block)
+{
+    return (block_footer_t *) ((uint8_t *) block + _block_size(block) - sizeof(block_footer_t));
+}
+
+static inline void _set_block(void *block, size_t size, bool used)
+{
+    block_header_t *header = block;
+    header->size = size | (used ? BLOCK_USED : 0);
+    header->magic = BLOCK_MAGIC;
+    *_block_footer(block) = header->size;
+}
 
-    block_header_t *current = _heap.free_list;
-    block_header_t *previous = NULL;
-    while (current != NULL && current < new_block) {
-        previous = current;
-        current = current->next;
+static inline int _size_class(size_t size)
+{
+    int class = 63 - __builtin_clzl(size) - HEAP_CLASS_SHIFT;
+    if (class < 0)
+        return 0;
+    return class < HEAP_CLASS_COUNT ? class : HEAP_CLASS_COUNT - 1;
+}
+
+static inline bool _is_fence(void *block)
+{
+    return ((block_header_t *) block)->size == BLOCK_USED;
+}
+
+static inline void _set_fence(void *block, bool chunk_start)
+{
+    block_header_t *fence = block;
+    fence->size = BLOCK_USED;
+    /* The second word of a start fence is read as the footer of a used block */
+    fence->magic = chunk_start ? BLOCK_USED : BLOCK_MAGIC;
+}
+
+static void _push_free_block(free_block_t *block)
+{
+    int class = _size_class(_block_size(block));
+    block->prev = NULL;
+    block->next = _heap.free_lists[class];
+    if (block->next != NULL)
+        block->next->prev = block;
+    _heap.free_lists[class] = block;
+    _heap.class_map |= 1U << class;
+    _heap.free_size += _block_size(block);
+    _free_blocks++;
+}
+
+static void _remove_free_block(free_block_t *block)
+{
+    int class = _size_class(_block_size(block));
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        _heap.free_lists[class] = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    if (_heap.free_lists[class] == NULL)
+        _heap.class_map &= ~(1U << class);
+    _heap.free_size -= _block_size(block);
+    _free_blocks--;
+}
+
+/*
+ * Returns a free block of at least size bytes, or NULL if there is none.
+ */
+static free_block_t *_find_free_block(size_t size)
+{
+    int class = _size_class(size);
+    free_block_t *block = _heap.free_lists[class];
+    for (int i = 0; block != NULL && i < HEAP_CLASS_SCAN; i++, block = block->next) {
+        if (_block_size(block) >= size)
+            return block;
     }
-    new_block->next = current;
-    if (previous == NULL) {
-        _heap.free_list = new_block;
-    } else {
-        previous->next = new_block;
+
+    /* Every block of a larger class is big enough */
+    uint32_t larger = class + 1 < HEAP_CLASS_COUNT ? _heap.class_map >> (class + 1) : 0;
+    if (larger == 0)
+        return NULL;
+    return _heap.free_lists[class + 1 + __builtin_ctz(larger)];
+}
+
+/*
+ * Returns the size of the block holding a payload of the given size, or 0 if that
+ * size is too big.
+ */
+static size_t _block_size_for(size_t size)
+{
+    if (size > SIZE_MAX - BLOCK_OVERHEAD - PAGE_SIZE)
+        return 0;
+
+    size_t block_size = (size + BLOCK_OVERHEAD + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1);
+    return block_size < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : block_size;
+}
+
+/*
+ * Gives the whole pages of a free block back to the PMM when the heap holds more free
+ * memory than it needs. What is left of the chunk on each side becomes a chunk of
+ * its own.
+ */
+static void _return_pages(free_block_t *block)
+{
+    /* The PMM is not safe to enter from IRQ handlers, the pages go back on a later free */
+    if (_heap.free_size <= HEAP_RELEASE_HIGH_PAGES * PAGE_SIZE || in_irq())
+        return;
+
+    uint8_t *start = (uint8_t *) block;
+    uint8_t *end = start + _block_size(block);
+
+    /* Pages start past an end fence and a free block big enough, or at a start fence */
+    uint8_t *low = start - sizeof(block_header_t);
+    bool low_fence = *(block_footer_t *) (start - sizeof(block_footer_t)) == BLOCK_USED;
+    if (!low_fence) {
+        low = (uint8_t *) PAGE_UP((uintptr_t) start + sizeof(block_header_t));
+        size_t head = low - start - sizeof(block_header_t);
+        if (head != 0 && head < BLOCK_MIN_SIZE)
+            low += PAGE_SIZE;
     }
 
-    _free_blocks++;
+    /* Pages end before a start fence and a free block big enough, or past an end fence */
+    uint8_t *high = end + sizeof(block_header_t);
+    bool high_fence = _is_fence(end);
+    if (!high_fence) {
+        high = (uint8_t *) PAGE_DOWN((uintptr_t) end - sizeof(block_header_t));
+        size_t tail = end - high - sizeof(block_header_t);
+        if (tail != 0 && tail < BLOCK_MIN_SIZE)
+            high -= PAGE_SIZE;
+    }
+
+    if (high <= low)
+        return;
+    size_t pages = (high - low) / PAGE_SIZE;
+    size_t spare_pages = (_heap.free_size - HEAP_RELEASE_LOW_PAGES * PAGE_SIZE) / PAGE_SIZE;
+    if (pages > spare_pages) {
+        pages = spare_pages;
+        high = low + pages * PAGE_SIZE;
+        high_fence = false;
+    }
+    if (pages == 0)
+        return;
+
+    _remove_free_block(block);
+    if (!low_fence) {
+        if ((size_t) (low - start) > sizeof(block_header_t)) {
+            _set_block(start, low - start - sizeof(block_header_t), false);
+            _push_free_block((free_block_t *) start);
+        }
+        _set_fence(low - sizeof(block_header_t), false);
+    }
+    if (!high_fence) {
+        _set_fence(high, true);
+        if ((size_t) (end - high) > sizeof(block_header_t)) {
+            _set_block(high + sizeof(block_header_t), end - high - sizeof(block_header_t), false);
+            _push_free_block((free_block_t *) (high + sizeof(block_header_t)));
+        }
+    }
+
+    pmm_free(vmm_get_lhdm_addr(low), pages);
+    _heap.total_size -= pages * PAGE_SIZE;
+    _released_pages += pages;
 }
 
-bool heap_init(size_t pages)
+/*
+ * Turns a range of a chunk into a free block, merged with its free neighbours.
+ */
+static void _release_block(uint8_t *block, size_t size)
 {
-    void *heap_memory = pmm_alloc(pages);
-    if (heap_memory == NULL) {
+    /* Merge with the next block if it is free */
+    uint8_t *next = block + size;
+    if (!_block_used(next)) {
+        _remove_free_block((free_block_t *) next);
+        size += _block_size(next);
+    }
+
+    /* Merge with the previous block if it is free */
+    block_footer_t previous_footer = *(block_footer_t *) (block - sizeof(block_footer_t));
+    if (!(previous_footer & BLOCK_USED)) {
+        block -= previous_footer;
+        _remove_free_block((free_block_t *) block);
+        size += previous_footer;
+    }
+
+    _set_block(block, size, false);
+    _push_free_block((free_block_t *) block);
+    _return_pages((free_block_t *) block);
+}
+
+/*
+ * Shrinks a used block to the given size and frees its tail, if the tail is big
+ * enough to be a block of its own.
+ */
+static void _trim_block(uint8_t *block, size_t size)
+{
+    size_t tail = _block_size(block) - size;
+    if (tail < BLOCK_MIN_SIZE)
+        return;
+
+    _set_block(block, size, true);
+    _release_block(block + size, tail);
+}
+
+/*
+ * Gives a chunk of pages to the heap as one free block.
+ */
+static bool _add_chunk(size_t pages)
+{
+    void *memory = pmm_alloc(pages);
+    if (memory == NULL)
+        return false;
+
+    uint8_t *chunk = vmm_get_hhdm_addr(memory);
+    size_t chunk_size = pages * PAGE_SIZE;
+
+    _set_fence(chunk, true);
+    _set_fence(chunk + chunk_size - sizeof(block_header_t), false);
+
+    free_block_t *block = (free_block_t *) (chunk + sizeof(block_header_t));
+    _set_block(block, chunk_size - CHUNK_OVERHEAD, false);
+    _push_free_block(block);
+    _heap.total_size += chunk_size;
+    return true;
+}
+
+bool __init heap_init(size_t pages)
+{
+    if (!_add_chunk(pages)) {
         debug_log("[-] Failed to initialize the heap!\n");
         return false;
     }
+    return true;
+}
 
-    _heap.start = vmm_get_hhdm_addr(heap_memory);
-    _heap.total_size = pages * PAGE_SIZE;
+/*
+ * Hands out the start of a range of free memory as a used block, and gives what is
+ * left back to the free lists if it is big enough to be a block of its own.
+ * Returns the payload of the used block.
+ */
+static void *_carve_block(uint8_t *block, size_t available, size_t block_size)
+{
+    size_t remaining = available - block_size;
+    if (remaining >= BLOCK_MIN_SIZE) {
+        free_block_t *rest = (free_block_t *) (block + block_size);
+        _set_block(rest, remaining, false);
+        _push_free_block(rest);
+    } else {
+        /* Use entire block */
+        block_size = available;
+    }
+    _set_block(block, block_size, true);
+    ((block_header_t *) block)->magic = BLOCK_MAGIC | cpu_get_id();
 
-    block_header_t *initial_block = (block_header_t *) _heap.start;
-    initial_block->size = _heap.total_size - sizeof(block_header_t);
-    initial_block->next = NULL;
-    _add_free_block(_heap.start, _heap.total_size);
+    _used_blocks++;
+    _used_memory += block_size - BLOCK_OVERHEAD;
+    return block + sizeof(block_header_t);
+}
 
-    return true;
+/*
+ * Returns a free block of at least size bytes, growing the heap if there is none and
+ * growing is allowed. The block is taken off the free lists.
+ */
+static free_block_t *_take_free_block(size_t size, bool grow)
+{
+    free_block_t *block = _find_free_block(size);
+    if (block == NULL) {
+        if (!grow)
+            return NULL;
+
+        /* If no suitable blocks found, grow the heap */
+        if (!_add_chunk(PAGE_UP(size + CHUNK_OVERHEAD) / PAGE_SIZE))
+            return NULL;
+        block = _find_free_block(size);
+    }
+    _remove_free_block(block);
+    return block;
 }
 
-void *kmalloc(size_t size)
+/*
+ * Takes a used block of at least size bytes of payload out of the heap, growing the
+ * heap only if allowed.
+ * Must be called with the heap lock held.
+ */
+static void *_heap_alloc(size_t size, bool grow)
 {
-    block_header_t *current, *previous;
-
-start:
-    current = _heap.free_list;
-    previous = NULL;
-
-    /* Search for a suitable free block */
-    while (current != NULL) {
-        if (current->size >= size + sizeof(block_header_t) + 8) {
-            /* Split block */
-            block_header_t *new_block = (block_header_t *) ((void *) current
-                                                            + sizeof(block_header_t) + size);
-            new_block->size = current->size - size - sizeof(block_header_t);
-            new_block->next = current->next;
-            current->size = size;
-            current->next = NULL;
-            if (previous != NULL) {
-                previous->next = new_block;
-            } else {
-                _heap.free_list = new_block;
-            }
-            _used_blocks++;
-            _used_memory += size;
-            return (void *) ((void *) current + sizeof(block_header_t));
-        } else if (current->size >= size) {
-            /* Use entire block */
-            if (previous != NULL) {
-                previous->next = current->next;
-            } else {
-                _heap.free_list = current->next;
-            }
-            _free_blocks--;
-            _used_blocks++;
-            _used_memory += current->size;
-            return (void *) ((void *) current + sizeof(block_header_t));
+    size_t block_size = _block_size_for(size);
+    if (block_size == 0)
+        return NULL;
+
+    free_block_t *block = _take_free_block(block_size, grow);
+    if (block == NULL)
+        return NULL;
+    return _carve_block((uint8_t *) block, _block_size(block), block_size);
+}
+
+/*
+ * Takes a used block whose payload starts on an align boundary out of the heap.
+ * The memory in front of the payload goes back to the free lists.
+ * Must be called with the heap lock held.
+ */
+static void *_heap_alloc_aligned(size_t size, size_t align, bool grow)
+{
+    size_t block_size = _block_size_for(size);
+    if (block_size == 0 || align > SIZE_MAX - block_size - BLOCK_MIN_SIZE)
+        return NULL;
+
+    /* The gap in front of the payload is either empty or a free block */
+    free_block_t *block = _take_free_block(block_size + align + BLOCK_MIN_SIZE, grow);
+    if (block == NULL)
+        return NULL;
+
+    uint8_t *start = (uint8_t *) block;
+    uintptr_t payload = ((uintptr_t) start + sizeof(block_header_t) + align - 1) & ~(align - 1);
+    size_t gap = payload - sizeof(block_header_t) - (uintptr_t) start;
+    if (gap != 0 && gap < BLOCK_MIN_SIZE)
+        gap += align;
+
+    size_t available = _block_size(block) - gap;
+    if (gap != 0) {
+        _set_block(start, gap, false);
+        _push_free_block((free_block_t *) start);
+    }
+    return _carve_block(start + gap, available, block_size);
+}
+
+/*
+ * Gives a used block back to the heap.
+ * Must be called with the heap lock held.
+ */
+static void _heap_free(void *pointer)
+{
+    uint8_t *block = (uint8_t *) pointer - sizeof(block_header_t);
+    size_t size = _block_size(block);
+    _used_blocks--;
+    _used_memory -= size - BLOCK_OVERHEAD;
+    _release_block(block, size);
+}
+
+/*
+ * Returns the CPU cache class serving a request of the given size, or -1 if the
+ * request is too big to be cached.
+ */
+static inline int _request_class(size_t size)
+{
+    if (size <= (1 << HEAP_CACHE_MIN_SHIFT))
+        return 0;
+    int class = 64 - __builtin_clzl(size - 1) - HEAP_CACHE_MIN_SHIFT;
+    return class < HEAP_CACHE_CLASSES ? class : -1;
+}
+
+/*
+ * Returns the CPU cache class a used block goes back to, or -1 if it is too big.
+ * Payloads between two class sizes serve requests of the smaller one.
+ */
+static inline int _block_class(void *block)
+{
+    int class = 63 - __builtin_clzl(_block_size(block) - BLOCK_OVERHEAD) - HEAP_CACHE_MIN_SHIFT;
+    return class >= 0 && class < HEAP_CACHE_CLASSES ? class : -1;
+}
+
+static inline block_header_t *_payload_header(void *pointer)
+{
+    return (block_header_t *) ((uint8_t *) pointer - sizeof(block_header_t));
+}
+
+static inline void _set_cached(void *pointer, bool cached)
+{
+    block_header_t *header = _payload_header(pointer);
+    header->magic = (cached ? BLOCK_CACHED : BLOCK_MAGIC) | (header->magic & BLOCK_OWNER_MASK);
+}
+
+static inline size_t _payload_size(void *pointer)
+{
+    return _block_size(_payload_header(pointer)) - BLOCK_OVERHEAD;
+}
+
+/*
+ * Gives up to count blocks of a magazine back to the heap.
+ * Must be called with interrupts disabled and the heap lock held.
+ */
+static void _flush_magazine(heap_cpu_cache_t *cache, heap_magazine_t *magazine, size_t count)
+{
+    for (; count > 0 && magazine->count > 0; count--) {
+        void *pointer = magazine->objects[--magazine->count];
+        cache->cached_memory -= _payload_size(pointer);
+        _set_cached(pointer, false);
+        _heap_free(pointer);
+    }
+}
+
+/*
+ * Keeps a block in a magazine of the current CPU, making room for it first if the
+ * magazine is full.
+ * Must be called with interrupts disabled.
+ */
+static void _cache_push(heap_cpu_cache_t *cache, int class, void *pointer)
+{
+    heap_magazine_t *magazine = &cache->magazines[class];
+    if (magazine->count == HEAP_CACHE_SIZE) {
+        spin_lock(&_heap_lock);
+        _flush_magazine(cache, magazine, HEAP_CACHE_BATCH);
+        spin_unlock(&_heap_lock);
+    }
+    _set_cached(pointer, true);
+    magazine->objects[magazine->count++] = pointer;
+    cache->cached_memory += _payload_size(pointer);
+}
+
+/*
+ * Hands a block freed on another CPU to the CPU that owns it.
+ */
+static void _push_remote_free(heap_cpu_cache_t *cache, void *pointer)
+{
+    _set_cached(pointer, true);
+    __atomic_fetch_add(&cache->remote_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->remote_memory, _payload_size(pointer), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_remote_frees, 1, __ATOMIC_RELAXED);
+
+    void *head = __atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **) pointer = head;
+    } while (!__atomic_compare_exchange_n(
+        &cache->remote_frees, &head, pointer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Moves the blocks other CPUs freed into the magazines of the current CPU. Blocks
+ * that do not fit go back to the heap.
+ * Must be called with interrupts disabled.
+ */
+static void _drain_remote_frees(heap_cpu_cache_t *cache)
+{
+    void *pointer = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    bool locked = false;
+    while (pointer != NULL) {
+        void *next = *(void **) pointer;
+        size_t size = _payload_size(pointer);
+        __atomic_fetch_sub(&cache->remote_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&cache->remote_memory, size, __ATOMIC_RELAXED);
+
+        heap_magazine_t *magazine = &cache->magazines[_block_class(_payload_header(pointer))];
+        if (magazine->count < HEAP_CACHE_SIZE) {
+            magazine->objects[magazine->count++] = pointer;
+            cache->cached_memory += size;
         } else {
-            previous = current;
-            current = current->next;
+            if (!locked)
+                spin_lock(&_heap_lock);
+            locked = true;
+            _set_cached(pointer, false);
+            _heap_free(pointer);
         }
+        pointer = next;
     }
-    /* If no suitable blocks found, grow the heap */
-    size_t growth_size = (size + sizeof(block_header_t) + PAGE_SIZE - 1) / PAGE_SIZE;
-    void *new_memory = pmm_alloc(growth_size);
-    if (new_memory != NULL) {
-        _add_free_block(vmm_get_hhdm_addr(new_memory), growth_size * PAGE_SIZE);
-        goto start;
+    if (locked)
+        spin_unlock(&_heap_lock);
+}
+
+/*
+ * Tops up the atomic reserve of a cache class.
+ * Must be called with interrupts disabled and the heap lock held.
+ */
+static void _reserve_refill(heap_cpu_cache_t *cache, int class)
+{
+    while (cache->reserve_count[class] < HEAP_RESERVE_SIZE) {
+        void *pointer = _heap_alloc((size_t) 1 << (class + HEAP_CACHE_MIN_SHIFT), true);
+        if (pointer == NULL)
+            return;
+        _set_cached(pointer, true);
+        cache->reserve[class][cache->reserve_count[class]++] = pointer;
+        cache->cached_memory += _payload_size(pointer);
     }
-    return NULL;
 }
 
-void *krealloc(void *pointer, size_t size)
+/*
+ * Takes a block from the atomic reserve of a cache class.
+ * Must be called with interrupts disabled.
+ * Returns the payload of the block, or NULL if the reserve is empty.
+ */
+static void *_reserve_pop(heap_cpu_cache_t *cache, int class)
+{
+    if (cache->reserve_count[class] == 0)
+        return NULL;
+
+    void *pointer = cache->reserve[class][--cache->reserve_count[class]];
+    cache->cached_memory -= _payload_size(pointer);
+    _set_cached(pointer, false);
+    return pointer;
+}
+
+/*
+ * Takes a block from a magazine of the current CPU, refilling the magazine from the
+ * remote frees or from the heap when it is empty. Atomic requests do not grow the
+ * heap and fall back to the reserve instead.
+ * Must be called with interrupts disabled.
+ * Returns the payload of the block, or NULL if no memory is left.
+ */
+static void *_cache_pop(heap_cpu_cache_t *cache, int class, bool atomic)
+{
+    heap_magazine_t *magazine = &cache->magazines[class];
+    if (magazine->count == 0 && cache->remote_frees != NULL)
+        _drain_remote_frees(cache);
+
+    if (magazine->count == 0) {
+        spin_lock(&_heap_lock);
+        while (magazine->count < HEAP_CACHE_BATCH) {
+            void *pointer = _heap_alloc((size_t) 1 << (class + HEAP_CACHE_MIN_SHIFT), !atomic);
+            if (pointer == NULL)
+                break;
+            _set_cached(pointer, true);
+            magazine->objects[magazine->count++] = pointer;
+            cache->cached_memory += _payload_size(pointer);
+        }
+        if (!atomic)
+            _reserve_refill(cache, class);
+        spin_unlock(&_heap_lock);
+        if (magazine->count == 0)
+            return atomic ? _reserve_pop(cache, class) : NULL;
+    } else {
+        cache->hits++;
+    }
+
+    void *pointer = magazine->objects[--magazine->count];
+    cache->cached_memory -= _payload_size(pointer);
+    _set_cached(pointer, false);
+    return pointer;
+}
+
+static inline heapprof_id_t _block_site(size_t magic)
+{
+    return (magic & BLOCK_SITE_MASK) >> BLOCK_SITE_SHIFT;
+}
+
+/*
+ * Counts a new allocation against a call site and remembers the site in the block.
+ */
+static void _profile_record(void *pointer, uintptr_t site, bool tagged)
 {
     if (pointer == NULL)
-        return kmalloc(size);
+        return;
 
-    block_header_t *block = (block_header_t *) ((void *) pointer - sizeof(block_header_t));
-    size_t old_size = block->size;
+    if (is_vmalloc_addr(pointer)) {
+        vmalloc_set_tag(pointer, heapprof_record_alloc(site, tagged, vmalloc_size(pointer)));
+        __atomic_fetch_add(&_profiled_areas, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    block_header_t *header = _payload_header(pointer);
+    heapprof_id_t id = heapprof_record_alloc(site, tagged, _payload_size(pointer));
+    header->magic = (header->magic & ~BLOCK_SITE_MASK) | ((size_t) id << BLOCK_SITE_SHIFT);
+}
 
-    if (size <= old_size)
+/*
+ * Takes a block out of the live counts of the profiler if it was allocated while the
+ * profiler was on.
+ */
+static void _profile_forget(void *pointer)
+{
+    if (is_vmalloc_addr(pointer)) {
+        if (__atomic_load_n(&_profiled_areas, __ATOMIC_RELAXED) == 0)
+            return;
+        heapprof_id_t id = vmalloc_get_tag(pointer);
+        if (id == HEAPPROF_ID_NONE)
+            return;
+        heapprof_record_free(id, vmalloc_size(pointer));
+        vmalloc_set_tag(pointer, HEAPPROF_ID_NONE);
+        __atomic_fetch_sub(&_profiled_areas, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    block_header_t *header = _payload_header(pointer);
+    heapprof_id_t id = _block_site(header->magic);
+    if (id == HEAPPROF_ID_NONE)
+        return;
+    heapprof_record_free(id, _payload_size(pointer));
+    header->magic &= ~BLOCK_SITE_MASK;
+}
+
+/*
+ * Returns true if an allocation must not grow the heap, because it was asked to be
+ * atomic or because it runs in an IRQ handler, which is reported.
+ */
+static bool _is_atomic(const char *caller, size_t size, int flags)
+{
+    if (flags & KMALLOC_ATOMIC)
+        return true;
+    if (__builtin_expect(in_irq(), false)) {
+        debug_log_fmt(
+            "[!] %s: Non-atomic allocation of %d bytes in an IRQ handler\n", caller, size);
+        __atomic_fetch_add(&_irq_violations, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
+static void *_kmalloc(size_t size, int flags)
+{
+    bool atomic = _is_atomic("kmalloc", size, flags);
+
+    /* Big requests do not need physically contiguous pages, unless they cannot sleep */
+    if (size >= VMALLOC_THRESHOLD && !atomic)
+        return vmalloc(size);
+
+    void *pointer;
+    int class = _request_class(size);
+    if (class >= 0) {
+        uint64_t irq_flags = cpu_irq_save();
+        pointer = _cache_pop(&_cpu_caches[cpu_get_id()], class, atomic);
+        cpu_irq_restore(irq_flags);
+    } else {
+        uint64_t irq_flags = spin_lock_irqsave(&_heap_lock);
+        pointer = _heap_alloc(size, !atomic);
+        spin_unlock_irqrestore(&_heap_lock, irq_flags);
+    }
+
+    if (pointer == NULL && atomic) {
+        debug_log_fmt("[-] kmalloc: Atomic allocation of %d bytes failed\n", size);
+        __atomic_fetch_add(&_atomic_failures, 1, __ATOMIC_RELAXED);
+    }
+    return pointer;
+}
+
+void *kmalloc(size_t size)
+{
+    void *pointer = _kmalloc(size, 0);
+    if (__builtin_expect(heapprof_enabled, false))
+        _profile_record(pointer, (uintptr_t) __builtin_return_address(0), false);
+    return pointer;
+}
+
+void *kmalloc_flags(size_t size, int flags)
+{
+    void *pointer = _kmalloc(size, flags);
+    if (__builtin_expect(heapprof_enabled, false))
+        _profile_record(pointer, (uintptr_t) __builtin_return_address(0), false);
+    return pointer;
+}
+
+void *kmalloc_tagged(size_t size, const char *tag)
+{
+    void *pointer = _kmalloc(size, 0);
+    if (__builtin_expect(heapprof_enabled, false))
+        _profile_record(pointer, (uintptr_t) tag, true);
+    return pointer;
+}
+
+void *kmalloc_aligned(size_t size, size_t align)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        debug_log_fmt("[!] kmalloc_aligned: Invalid alignment %d\n", align);
+        return NULL;
+    }
+
+    bool atomic = _is_atomic("kmalloc_aligned", size, 0);
+    void *pointer;
+    if (align <= HEAP_ALIGNMENT) {
+        pointer = _kmalloc(size, atomic ? KMALLOC_ATOMIC : 0);
+    } else if (size >= VMALLOC_THRESHOLD && align <= PAGE_SIZE && !atomic) {
+        /* vmalloc areas start on a page boundary */
+        pointer = vmalloc(size);
+    } else {
+        uint64_t flags = spin_lock_irqsave(&_heap_lock);
+        pointer = _heap_alloc_aligned(size, align, !atomic);
+        spin_unlock_irqrestore(&_heap_lock, flags);
+        if (pointer == NULL && atomic)
+            __atomic_fetch_add(&_atomic_failures, 1, __ATOMIC_RELAXED);
+    }
+
+    if (__builtin_expect(heapprof_enabled, false))
+        _profile_record(pointer, (uintptr_t) __builtin_return_address(0), false);
+    return pointer;
+}
+
+/*
+ * Resizes a block, forgetting its profiler site when it stays in place.
+ */
+static void *_krealloc(void *pointer, size_t size)
+{
+    /* In IRQ handlers, only the free blocks already in the heap are used */
+    int alloc_flags = _is_atomic("krealloc", size, 0) ? KMALLOC_ATOMIC : 0;
+    if (pointer == NULL)
+        return _kmalloc(size, alloc_flags);
+
+    if (is_vmalloc_addr(pointer)) {
+        /* Resizing an area maps or frees pages */
+        if (alloc_flags & KMALLOC_ATOMIC) {
+            __atomic_fetch_add(&_atomic_failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        size_t old_size = vmalloc_size(pointer);
+        heapprof_id_t id = vmalloc_get_tag(pointer);
+        if (vmalloc_resize(pointer, size)) {
+            if (id != HEAPPROF_ID_NONE) {
+                heapprof_record_free(id, old_size);
+                vmalloc_set_tag(pointer, HEAPPROF_ID_NONE);
+                __atomic_fetch_sub(&_profiled_areas, 1, __ATOMIC_RELAXED);
+            }
+            return pointer;
+        }
+
+        void *new_pointer = _kmalloc(size, alloc_flags);
+        if (new_pointer != NULL) {
+            memcpy(new_pointer, pointer, size < old_size ? size : old_size);
+            kfree(pointer);
+        }
+        return new_pointer;
+    }
+
+    uint8_t *block = (uint8_t *) pointer - sizeof(block_header_t);
+    size_t block_size = _block_size_for(size);
+    if (block_size == 0)
+        return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&_heap_lock);
+    size_t old_block_size = _block_size(block);
+    size_t magic = ((block_header_t *) block)->magic;
+
+    /* Grow into the next block when it is free and big enough */
+    uint8_t *next = block + old_block_size;
+    if (block_size > old_block_size && !_block_used(next)
+        && old_block_size + _block_size(next) >= block_size) {
+        _remove_free_block((free_block_t *) next);
+        _set_block(block, old_block_size + _block_size(next), true);
+    }
+
+    if (block_size <= _block_size(block)) {
+        _trim_block(block, block_size);
+        ((block_header_t *) block)->magic = magic & ~BLOCK_SITE_MASK;
+        _used_memory += _block_size(block);
+        _used_memory -= old_block_size;
+        _inplace_reallocs++;
+        spin_unlock_irqrestore(&_heap_lock, flags);
+        if (_block_site(magic) != HEAPPROF_ID_NONE)
+            heapprof_record_free(_block_site(magic), old_block_size - BLOCK_OVERHEAD);
         return pointer;
+    }
+    spin_unlock_irqrestore(&_heap_lock, flags);
 
-    void *new_pointer = kmalloc(size);
+    void *new_pointer = _kmalloc(size, alloc_flags);
     if (new_pointer != NULL) {
-        memcpy(new_pointer, pointer, old_size);
+        memcpy(new_pointer, pointer, old_block_size - BLOCK_OVERHEAD);
         kfree(pointer);
+        __atomic_fetch_add(&_copied_reallocs, 1, __ATOMIC_RELAXED);
     }
     return new_pointer;
 }
 
+void *krealloc(void *pointer, size_t size)
+{
+    void *new_pointer = _krealloc(pointer, size);
+    if (__builtin_expect(heapprof_enabled, false))
+        _profile_record(new_pointer, (uintptr_t) __builtin_return_address(0), false);
+    return new_pointer;
+}
+
 void kfree(void *pointer)
 {
     if (pointer == NULL)
         return;
 
-    block_header_t *block = (block_header_t *) ((void *) pointer - sizeof(block_header_t));
-    size_t freed_size = block->size;
-
-    block_header_t *current = _heap.free_list;
-    block_header_t *previous = NULL;
-    while (current != NULL && current < block) {
-        previous = current;
-        current = current->next;
+    if (is_vmalloc_addr(pointer)) {
+        if (__builtin_expect(in_irq(), false)) {
+            /* vfree only queues the area here */
+            debug_log_fmt("[!] kfree: 0x%x is a vmalloc block freed in an IRQ handler\n", pointer);
+            __atomic_fetch_add(&_irq_violations, 1, __ATOMIC_RELAXED);
+        }
+        _profile_forget(pointer);
+        vfree(pointer);
+        return;
     }
 
-    /* Insert the block into the free list */
-    block->next = current;
-    if (previous == NULL) {
-        _heap.free_list = block;
-    } else {
-        previous->next = block;
+    block_header_t *header = _payload_header(pointer);
+    if ((header->magic & ~(BLOCK_SITE_MASK | BLOCK_OWNER_MASK)) != BLOCK_MAGIC
+        || !_block_used(header)
+        || (header->magic & BLOCK_OWNER_MASK) >= MAX_CPUS) {
+        debug_log_fmt("[!] kfree: 0x%x is not an allocated heap block\n", pointer);
+        return;
     }
+    _profile_forget(pointer);
 
-    _free_blocks++;
-    _used_blocks--;
-    _used_memory -= freed_size;
-
-    /* Merge with the previous block if adjacent */
-    if (previous != NULL
-        && (void *) previous + sizeof(block_header_t) + previous->size == (void *) block) {
-        previous->size += sizeof(block_header_t) + block->size;
-        previous->next = block->next;
-        block = previous; /* Update block to point to the merged block */
-        _free_blocks--;
+    int class = _block_class(header);
+    if (class < 0) {
+        uint64_t flags = spin_lock_irqsave(&_heap_lock);
+        _heap_free(pointer);
+        spin_unlock_irqrestore(&_heap_lock, flags);
+        return;
     }
 
-    /* Merge with the next block if adjacent */
-    if (block->next != NULL
-        && (void *) block + sizeof(block_header_t) + block->size == (void *) block->next) {
-        block->size += sizeof(block_header_t) + block->next->size;
-        block->next = block->next->next;
-        _free_blocks--;
-    }
+    /* Small blocks go back to the cache of the CPU that took them from the heap */
+    uint64_t flags = cpu_irq_save();
+    uint32_t owner = header->magic & BLOCK_OWNER_MASK;
+    if (owner != cpu_get_id())
+        _push_remote_free(&_cpu_caches[owner], pointer);
+    else
+        _cache_push(&_cpu_caches[owner], class, pointer);
+    cpu_irq_restore(flags);
 }
 
 heap_stats_t heap_get_stats()
 {
-    return (heap_stats_t) {
+    size_t cached_blocks = 0;
+    size_t cached_memory = 0;
+    size_t reserved_blocks = 0;
+    size_t cache_hits = 0;
+    for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        heap_cpu_cache_t *cache = &_cpu_caches[cpu];
+        for (int class = 0; class < HEAP_CACHE_CLASSES; class++) {
+            cached_blocks += cache->magazines[class].count;
+            reserved_blocks += cache->reserve_count[class];
+        }
+        cached_blocks += __atomic_load_n(&cache->remote_count, __ATOMIC_RELAXED);
+        cached_memory += cache->cached_memory;
+        cached_memory += __atomic_load_n(&cache->remote_memory, __ATOMIC_RELAXED);
+        cache_hits += cache->hits;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&_heap_lock);
+    heap_stats_t stats = {
         .free_blocks = _free_blocks,
-        .used_blocks = _used_blocks,
-        .used_memory = _used_memory,
+        .used_blocks = _used_blocks - cached_blocks - reserved_blocks,
+        .used_memory = _used_memory - cached_memory,
+        .inplace_reallocs = _inplace_reallocs,
+        .copied_reallocs = _copied_reallocs,
+        .held_pages = _heap.total_size / PAGE_SIZE,
+        .used_pages = PAGE_UP(_heap.total_size - _heap.free_size) / PAGE_SIZE,
+        .released_pages = _released_pages,
+        .cached_blocks = cached_blocks,
+        .cache_hits = cache_hits,
+        .remote_frees = _remote_frees,
+        .lock_contentions = _heap_lock.contentions,
+        .reserved_blocks = reserved_blocks,
+        .atomic_failures = _atomic_failures,
+        .irq_violations = _irq_violations,
     };
+    spin_unlock_irqrestore(&_heap_lock, flags);
+    return stats;
 }
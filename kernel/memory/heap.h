@@ -16,8 +16,25 @@ typedef struct
     size_t free_blocks;
     size_t used_blocks;
     size_t used_memory;
+    size_t inplace_reallocs; /* krealloc calls that kept the block where it was */
+    size_t copied_reallocs;  /* krealloc calls that moved the data to a new block */
+    size_t held_pages;       /* Pages taken from the PMM and still held */
+    size_t used_pages;       /* Pages worth of used blocks */
+    size_t released_pages;   /* Pages given back to the PMM so far */
+    size_t cached_blocks;    /* Freed small blocks kept by the CPU caches */
+    size_t cache_hits;       /* kmalloc calls served by a CPU cache */
+    size_t remote_frees;     /* Blocks freed on a CPU other than the one caching them */
+    size_t lock_contentions; /* Times the heap lock was found taken */
+    size_t reserved_blocks;  /* Blocks the CPUs keep aside for atomic allocations */
+    size_t atomic_failures;  /* Atomic allocations that found no memory */
+    size_t irq_violations;   /* Non-atomic allocations and vmalloc frees in IRQ handlers */
 } heap_stats_t;
 
+/*
+ * Flags of kmalloc_flags.
+ */
+#define KMALLOC_ATOMIC (1 << 0) /* Never grow the heap, for IRQ handlers */
+
 /*
  * Initialize the heap with the specified amount of pages.
  * Returns true if successful, false otherwise.
@@ -26,12 +43,39 @@ bool heap_init(size_t pages);
 
 /*
  * Allocates a block of memory of the specified size.
+ * Requests of up to 512 bytes are served by a cache of the current CPU, and requests
+ * of VMALLOC_THRESHOLD bytes or more are served by vmalloc.
  * Returns a pointer to the allocated memory, or NULL if the allocation fails.
  */
 void *kmalloc(size_t size);
 
+/*
+ * Allocates a block of memory like kmalloc. Atomic allocations are served from the
+ * free blocks of the heap and the reserve of the CPU, never from new pages, so that
+ * they are safe and quick in IRQ handlers. They fail rather than wait for memory.
+ * Returns a pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void *kmalloc_flags(size_t size, int flags);
+
+/*
+ * Allocates a block of memory like kmalloc, but reports it to the allocation
+ * profiler under the given tag instead of the address of the caller.
+ */
+void *kmalloc_tagged(size_t size, const char *tag);
+
+/*
+ * Allocates a block of memory of the specified size whose address is a multiple of
+ * align, which must be a power of two. The memory skipped to reach the boundary
+ * stays in the heap. The block is freed with kfree, and krealloc may move it to an
+ * address that is not aligned any more.
+ * Returns a pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void *kmalloc_aligned(size_t size, size_t align);
+
 /*
  * Reallocates a block of memory of the specified size.
+ * The block grows into the free block after it, or gives back its tail when it
+ * shrinks, before falling back to moving the data to a new block.
  * Returns a pointer to the reallocated memory, or NULL if the reallocation fails.
  */
 void *krealloc(void *pointer, size_t size);
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/spinlock.h>
+#include <kernel/debug.h>
+#include <kernel/memory/heapprof.h>
+#include <kernel/timer.h>
+
+bool heapprof_enabled = false;
+
+/* Open addressing table of the sites, followed by the site counting the rest */
+static heapprof_site_t _sites[HEAPPROF_MAX_SITES + 1];
+static size_t _site_count = 0;
+static uint64_t _reset_ticks = 0;
+static spinlock_t _lock;
+
+static inline size_t _site_hash(uintptr_t site)
+{
+    return (((uint64_t) site >> 2) * 0x9E3779B97F4A7C15ULL >> 32) & (HEAPPROF_MAX_SITES - 1);
+}
+
+/*
+ * Returns the index of the entry of a site, adding the site if it is new, or the
+ * index of the last entry if the table is full.
+ * Must be called with the profiler lock held.
+ */
+static size_t _site_index(uintptr_t site, bool tagged)
+{
+    size_t index = _site_hash(site);
+    for (size_t probes = 0; probes < HEAPPROF_MAX_SITES; probes++) {
+        if (_sites[index].site == site)
+            return index;
+        if (_sites[index].site == 0) {
+            if (_site_count == HEAPPROF_MAX_SITES - 1)
+                break;
+            _sites[index].site = site;
+            _sites[index].tagged = tagged;
+            _site_count++;
+            return index;
+        }
+        index = (index + 1) & (HEAPPROF_MAX_SITES - 1);
+    }
+    return HEAPPROF_MAX_SITES;
+}
+
+void heapprof_set_enabled(bool enabled)
+{
+    if (enabled && !heapprof_enabled)
+        heapprof_reset();
+    heapprof_enabled = enabled;
+    debug_log_fmt("[*] Allocation profiler %s\n", enabled ? "enabled" : "disabled");
+}
+
+void heapprof_reset()
+{
+    uint64_t flags = spin_lock_irqsave(&_lock);
+    for (size_t i = 0; i <= HEAPPROF_MAX_SITES; i++)
+        _sites[i].allocations = 0;
+    _reset_ticks = timer_get_ticks();
+    spin_unlock_irqrestore(&_lock, flags);
+}
+
+heapprof_id_t heapprof_record_alloc(uintptr_t site, bool tagged, size_t bytes)
+{
+    uint64_t flags = spin_lock_irqsave(&_lock);
+    size_t index = _site_index(site, tagged);
+    _sites[index].live_blocks++;
+    _sites[index].live_bytes += bytes;
+    _sites[index].allocations++;
+    spin_unlock_irqrestore(&_lock, flags);
+    return index + 1;
+}
+
+void heapprof_record_free(heapprof_id_t id, size_t bytes)
+{
+    if (id == HEAPPROF_ID_NONE || id > HEAPPROF_MAX_SITES + 1)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&_lock);
+    _sites[id - 1].live_blocks--;
+    _sites[id - 1].live_bytes -= bytes;
+    spin_unlock_irqrestore(&_lock, flags);
+}
+
+size_t heapprof_get_top(heapprof_site_t *sites, size_t max)
+{
+    size_t count = 0;
+    uint64_t flags = spin_lock_irqsave(&_lock);
+    uint64_t elapsed = timer_get_ticks() - _reset_ticks;
+    for (size_t i = 0; i <= HEAPPROF_MAX_SITES; i++) {
+        heapprof_site_t site = _sites[i];
+        if (site.live_blocks == 0 && site.allocations == 0)
+            continue;
+        site.rate = elapsed != 0 ? site.allocations * 1000 / elapsed : site.allocations;
+
+        /* Insertion into the sorted output, dropping whatever falls past max */
+        size_t position = count < max ? count : max;
+        while (position > 0 && sites[position - 1].live_bytes < site.live_bytes) {
+            if (position < max)
+                sites[position] = sites[position - 1];
+            position--;
+        }
+        if (position < max) {
+            sites[position] = site;
+            if (count < max)
+                count++;
+        }
+    }
+    spin_unlock_irqrestore(&_lock, flags);
+    return count;
+}
+
+void heapprof_dump(size_t count)
+{
+    heapprof_site_t sites[HEAPPROF_TOP_MAX];
+    count = heapprof_get_top(sites, count < HEAPPROF_TOP_MAX ? count : HEAPPROF_TOP_MAX);
+
+    debug_log_fmt("[*] Top %d allocation sites by live bytes:\n", count);
+    for (size_t i = 0; i < count; i++) {
+        heapprof_site_t *site = &sites[i];
+        if (site->tagged)
+            debug_log_fmt("    %s: ", (const char *) site->site);
+        else if (site->site != 0)
+            debug_log_fmt("    0x%x: ", site->site);
+        else
+            debug_log("    other: ");
+        debug_log_fmt(
+            "%d bytes in %d blocks, %d allocations (%d/s)\n",
+            site->live_bytes,
+            site->live_blocks,
+            site->allocations,
+            site->rate);
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Number of call sites tracked by the allocation profiler. Allocations made from
+ * further sites are counted under a single site shown as "other".
+ */
+#define HEAPPROF_MAX_SITES 256
+
+/*
+ * Largest number of sites reported at once.
+ */
+#define HEAPPROF_TOP_MAX 32
+
+/*
+ * Identifier of a call site stored in profiled blocks. Blocks allocated while the
+ * profiler was off carry HEAPPROF_ID_NONE.
+ */
+typedef uint16_t heapprof_id_t;
+#define HEAPPROF_ID_NONE 0
+
+/*
+ * Allocation statistics of one call site.
+ */
+typedef struct
+{
+    uintptr_t site;     /* Return address of the caller, or its tag string */
+    bool tagged;        /* Whether site is a tag string */
+    size_t live_blocks;
+    size_t live_bytes;  /* Usable bytes of the live blocks */
+    size_t allocations; /* Allocations since the profiler was last reset */
+    size_t rate;        /* Allocations per second since the profiler was last reset */
+} heapprof_site_t;
+
+/*
+ * Set while allocations are recorded. It is tested on every allocation, so that the
+ * profiler costs a single branch while it is off.
+ */
+extern bool heapprof_enabled;
+
+/*
+ * Start or stop recording allocations. Starting clears the allocation counts. The
+ * live counts of the sites keep dropping as their blocks are freed either way.
+ */
+void heapprof_set_enabled(bool enabled);
+
+/*
+ * Clear the allocation counts and restart the rate measurement.
+ */
+void heapprof_reset();
+
+/*
+ * Count a new block of the given size against a call site.
+ * Returns the identifier to store in the block.
+ */
+heapprof_id_t heapprof_record_alloc(uintptr_t site, bool tagged, size_t bytes);
+
+/*
+ * Remove a freed block from the live counts of the site it was allocated from.
+ */
+void heapprof_record_free(heapprof_id_t id, size_t bytes);
+
+/*
+ * Stores up to max sites, those holding the most live bytes first.
+ * Returns the number of sites stored.
+ */
+size_t heapprof_get_top(heapprof_site_t *sites, size_t max);
+
+/*
+ * Print the count sites holding the most live bytes to the debug log.
+ */
+void heapprof_dump(size_t count);
@@ -3,12 +3,20 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include <kernel/arch/pc/asm.h>
+#include <kernel/arch/pc/cpu.h>
 #include <kernel/klibc/string.h>
+#include <kernel/memory/compact.h>
 #include <kernel/memory/heap.h>
+#include <kernel/memory/heapprof.h>
 #include <kernel/memory/memstat.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/memory/slab.h>
+#include <kernel/memory/vmalloc.h>
+#include <kernel/memory/vmm.h>
 #include <kernel/terminal/kshell.h>
 #include <kernel/terminal/terminal.h>
+#include <kernel/usermode/fault.h>
 
 static void _free(int argc, char *argv[])
 {
@@ -41,6 +49,258 @@ static void _alloc(int argc, char *argv[])
     kprintf("\n[+] Allocated %s bytes at 0x%x", argv[1], ptr);
 }
 
+static void _compact(int argc, char *argv[])
+{
+    if (argc > 2) {
+        kprintf("\n[*] Usage: compact [order]");
+        return;
+    }
+
+    int order = argc == 2 ? atoi(argv[1]) : PMM_ORDER_2M;
+    if (order <= 0 || order > PMM_MAX_ORDER) {
+        kprintf("\n[-] The order must be between 1 and %d", PMM_MAX_ORDER);
+        return;
+    }
+
+    kprintf("\n[*] Fragmentation index before: %d", pmm_fragmentation_index(order));
+    size_t evacuated = compact_memory(order, COMPACT_MAX_BLOCKS);
+    kprintf("\n[*] Fragmentation index after: %d", pmm_fragmentation_index(order));
+    kprintf("\n[+] Rebuilt %d free order-%d blocks", evacuated, order);
+}
+
+/*
+ * Allocates a huge block and checks that it is naturally aligned and owned by the
+ * caller, then gives it back.
+ */
+static void _huge_test(int order)
+{
+    pmm_stats_t before = pmm_get_stats();
+    size_t pages = (size_t) 1 << order;
+    void *block = pmm_alloc_huge(order);
+    if (block == NULL) {
+        kprintf("\n[-] No block of order %d could be allocated", order);
+        return;
+    }
+
+    pmm_stats_t during = pmm_get_stats();
+    bool from_reserve = during.reserved_2m_frames + during.reserved_1g_frames
+                        < before.reserved_2m_frames + before.reserved_1g_frames;
+    page_t *first = page_lookup((uintptr_t) block);
+    page_t *last = page_lookup((uintptr_t) block + (pages - 1) * PAGE_SIZE);
+    bool aligned = ((uintptr_t) block & ((PAGE_SIZE << order) - 1)) == 0;
+    bool owned = first != NULL && last != NULL && first->refcount == 1 && last->refcount == 1;
+    kprintf(
+        "\n[%c] Order %d block at 0x%x from the %s: %s, %s",
+        aligned && owned ? '+' : '-',
+        order,
+        block,
+        from_reserve ? "reserve" : "free lists",
+        aligned ? "naturally aligned" : "MISALIGNED",
+        owned ? "owned" : "NOT OWNED");
+
+    pmm_free(block, pages);
+    pmm_stats_t after = pmm_get_stats();
+    if (after.used_pages != before.used_pages)
+        kprintf("\n[-] %d pages were not given back", after.used_pages - before.used_pages);
+}
+
+static void _huge(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "reserve") == 0) {
+        long held = pmm_set_huge_reserve(atoi(argv[2]), atoul(argv[3]));
+        if (held < 0)
+            kprintf("\n[-] Only orders %d and %d have a reserve", PMM_ORDER_2M, PMM_ORDER_1G);
+        else
+            kprintf("\n[+] %d frames of order %s are reserved", held, argv[2]);
+        return;
+    }
+    if (argc > 2) {
+        kprintf("\n[*] Usage: huge [order] | huge reserve <order> <count>");
+        return;
+    }
+
+    int order = argc == 2 ? atoi(argv[1]) : PMM_ORDER_2M;
+    if (order <= 0 || order > PMM_MAX_ORDER) {
+        kprintf("\n[-] The order must be between 1 and %d", PMM_MAX_ORDER);
+        return;
+    }
+    _huge_test(order);
+}
+
+/*
+ * Pages and sweeps used by the page coloring benchmark.
+ */
+#define COLOR_BENCH_MAX_PAGES 64
+#define COLOR_BENCH_PASSES 256
+
+/*
+ * Touches every cache line of a set of pages, over and over.
+ * Returns the average number of cycles taken by one sweep.
+ */
+static uint64_t _color_sweep(void **pages, size_t count)
+{
+    uint64_t start = asm_rdtsc();
+    for (int pass = 0; pass < COLOR_BENCH_PASSES; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            volatile uint64_t *page = vmm_get_hhdm_addr(pages[i]);
+            for (size_t word = 0; word < PAGE_SIZE / sizeof(uint64_t); word += 8)
+                page[word]++;
+        }
+    }
+    return (asm_rdtsc() - start) / COLOR_BENCH_PASSES;
+}
+
+/*
+ * Sweeps twice the cache associativity worth of pages, first all of the same color
+ * as happens when unrelated hot pages alias, then spread over consecutive colors.
+ * The first set keeps evicting itself from a handful of cache sets.
+ */
+static void _color_bench()
+{
+    cpu_cache_info_t llc;
+    if (!cpu_get_llc_info(&llc)) {
+        kprintf("\n[-] The processor does not report its cache geometry");
+        return;
+    }
+
+    size_t count = llc.ways * 2;
+    if (count > COLOR_BENCH_MAX_PAGES)
+        count = COLOR_BENCH_MAX_PAGES;
+
+    pmm_stats_t stats = pmm_get_stats();
+    pmm_set_coloring(true);
+
+    void *aliased[COLOR_BENCH_MAX_PAGES] = {0};
+    void *spread[COLOR_BENCH_MAX_PAGES] = {0};
+    pmm_color_t spread_color = {0};
+    for (size_t i = 0; i < count; i++) {
+        pmm_color_t same_color = {0};
+        aliased[i] = pmm_alloc_colored(1, &same_color);
+        spread[i] = pmm_alloc_colored(1, &spread_color);
+    }
+
+    bool allocated = true;
+    for (size_t i = 0; i < count; i++)
+        allocated = allocated && aliased[i] && spread[i];
+    if (allocated) {
+        _color_sweep(aliased, count);
+        kprintf(
+            "\n[*] %d pages of color %d: %d cycles per sweep",
+            count,
+            pmm_get_color((uintptr_t) aliased[0]),
+            _color_sweep(aliased, count));
+        _color_sweep(spread, count);
+        kprintf(
+            "\n[*] %d pages of colors 0-%d: %d cycles per sweep",
+            count,
+            count - 1,
+            _color_sweep(spread, count));
+    } else {
+        kprintf("\n[-] Could not allocate the benchmark pages");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        pmm_free(aliased[i], 1);
+        pmm_free(spread[i], 1);
+    }
+    pmm_set_coloring(stats.coloring);
+}
+
+static void _color(int argc, char *argv[])
+{
+    if (argc != 2) {
+        kprintf("\n[*] Usage: color <on|off|bench>");
+        return;
+    }
+
+    if (strcmp(argv[1], "on") == 0) {
+        pmm_set_coloring(true);
+        kprintf("\n[+] Page coloring enabled (%d colors)", pmm_get_stats().color_count);
+    } else if (strcmp(argv[1], "off") == 0) {
+        pmm_set_coloring(false);
+        kprintf("\n[+] Page coloring disabled");
+    } else if (strcmp(argv[1], "bench") == 0) {
+        _color_bench();
+    } else {
+        kprintf("\n[*] Usage: color <on|off|bench>");
+    }
+}
+
+/*
+ * Prints the sites holding the most live heap memory, on the terminal and over
+ * the debug log.
+ */
+static void _heapprof_top(size_t count)
+{
+    heapprof_site_t sites[HEAPPROF_TOP_MAX];
+    count = heapprof_get_top(sites, count < HEAPPROF_TOP_MAX ? count : HEAPPROF_TOP_MAX);
+    if (count == 0) {
+        kprintf("\n[*] No allocation recorded");
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (sites[i].tagged)
+            kprintf("\n[*] %s: ", (const char *) sites[i].site);
+        else if (sites[i].site != 0)
+            kprintf("\n[*] 0x%x: ", sites[i].site);
+        else
+            kprintf("\n[*] other: ");
+        kprintf(
+            "%d bytes in %d blocks, %d allocations (%d/s)",
+            sites[i].live_bytes,
+            sites[i].live_blocks,
+            sites[i].allocations,
+            sites[i].rate);
+    }
+    heapprof_dump(count);
+}
+
+static void _heapprof(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        kprintf("\n[*] Usage: heapprof <on|off|reset|top [count]>");
+        return;
+    }
+
+    if (strcmp(argv[1], "on") == 0) {
+        heapprof_set_enabled(true);
+        kprintf("\n[+] Allocation profiler enabled");
+    } else if (strcmp(argv[1], "off") == 0) {
+        heapprof_set_enabled(false);
+        kprintf("\n[+] Allocation profiler disabled");
+    } else if (strcmp(argv[1], "reset") == 0) {
+        heapprof_reset();
+        kprintf("\n[+] Allocation counts cleared");
+    } else if (strcmp(argv[1], "top") == 0) {
+        _heapprof_top(argc == 3 ? atoul(argv[2]) : 10);
+    } else {
+        kprintf("\n[*] Usage: heapprof <on|off|reset|top [count]>");
+    }
+}
+
+static void _slabinfo(int, char **)
+{
+    kmem_cache_stats_t stats[SLAB_MAX_CACHES];
+    size_t count = kmem_cache_get_stats(stats, SLAB_MAX_CACHES);
+    for (size_t i = 0; i < count; i++) {
+        kprintf(
+            "\n[*] %s: %d of %d objects of %d bytes in use, slabs %d/%d/%d (full/partial/empty)",
+            stats[i].name,
+            stats[i].active_objects,
+            stats[i].total_objects,
+            stats[i].object_size,
+            stats[i].full_slabs,
+            stats[i].partial_slabs,
+            stats[i].empty_slabs);
+        kprintf(
+            "\n    %d allocations, %d frees, %d objects per slab",
+            stats[i].allocations,
+            stats[i].frees,
+            stats[i].objects_per_slab);
+    }
+}
+
 static void _memstat_print_stats(int, char **)
 {
     pmm_stats_t pmm_info = pmm_get_stats();
@@ -51,12 +311,97 @@ static void _memstat_print_stats(int, char **)
     kprintf("\n[*] Total physical memory pages: %d pages", pmm_info.total_pages);
     kprintf("\n[*] Free physical memory pages: %d pages", pmm_info.free_pages);
     kprintf(
-        "\n[*] Used physical memory pages: %d pages\n", pmm_info.total_pages - pmm_info.free_pages);
+        "\n[*] Used physical memory pages: %d pages", pmm_info.total_pages - pmm_info.free_pages);
+    kprintf(
+        "\n[*] Per-CPU cached pages: %d pages (%d per CPU at most)",
+        pmm_info.cached_pages,
+        PMM_MAGAZINE_SIZE);
+    kprintf(
+        "\n[*] Pre-zeroed pages: %d pages (%d at most)", pmm_info.zeroed_pages, PMM_ZERO_POOL_SIZE);
+    kprintf(
+        "\n[*] Page coloring: %s, %d colors, %d pages in color bins",
+        pmm_info.coloring ? "on" : "off",
+        pmm_info.color_count,
+        pmm_info.colored_pages);
+    kprintf(
+        "\n[*] Reserved huge frames: %d of 2 MiB, %d of 1 GiB",
+        pmm_info.reserved_2m_frames,
+        pmm_info.reserved_1g_frames);
+
+    size_t region_count;
+    const pmm_region_t *regions = pmm_get_regions(&region_count);
+    for (size_t i = 0; i < region_count; i++) {
+        kprintf(
+            "\n[*] Region %d: 0x%x-0x%x (%d pages)",
+            i,
+            regions[i].base,
+            regions[i].base + regions[i].page_count * PAGE_SIZE,
+            regions[i].page_count);
+    }
+    for (size_t node = 0; node < pmm_info.node_count; node++) {
+        kprintf(
+            "\n[*] NUMA node %d: %d of %d pages free",
+            node,
+            pmm_info.node_free_pages[node],
+            pmm_info.node_total_pages[node]);
+    }
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        if (pmm_info.free_blocks[order] == 0)
+            continue;
+        kprintf(
+            "\n[*] Free order-%d blocks (%d KB): %d",
+            order,
+            (PAGE_SIZE << order) / 1024,
+            pmm_info.free_blocks[order]);
+    }
+    kputc('\n');
 
-    kprintf("\n[*] Total heap blocks: %d blocks", heap_stats.free_blocks + heap_stats.used_blocks);
+    kprintf(
+        "\n[*] Total heap blocks: %d blocks",
+        heap_stats.free_blocks + heap_stats.used_blocks + heap_stats.cached_blocks
+            + heap_stats.reserved_blocks);
     kprintf("\n[*] Free heap blocks: %d blocks", heap_stats.free_blocks);
     kprintf("\n[*] Used heap blocks: %d blocks", heap_stats.used_blocks);
+    kprintf("\n[*] CPU cached heap blocks: %d blocks", heap_stats.cached_blocks);
     kprintf("\n[*] Allocated heap memory: %d bytes", heap_stats.used_memory);
+    kprintf(
+        "\n[*] Heap pages: %d held, %d in use, %d given back",
+        heap_stats.held_pages,
+        heap_stats.used_pages,
+        heap_stats.released_pages);
+    kprintf(
+        "\n[*] Reallocations: %d in place, %d copied",
+        heap_stats.inplace_reallocs,
+        heap_stats.copied_reallocs);
+    kprintf(
+        "\n[*] Heap CPU caches: %d hits, %d remote frees, %d lock contentions",
+        heap_stats.cache_hits,
+        heap_stats.remote_frees,
+        heap_stats.lock_contentions);
+    kprintf(
+        "\n[*] Atomic allocations: %d reserved blocks, %d failures, %d IRQ violations",
+        heap_stats.reserved_blocks,
+        heap_stats.atomic_failures,
+        heap_stats.irq_violations);
+
+    vmalloc_stats_t vmalloc_stats = vmalloc_get_stats();
+    kprintf(
+        "\n[*] vmalloc: %d allocations backed by %d pages, %d frees deferred from IRQs",
+        vmalloc_stats.areas,
+        vmalloc_stats.mapped_pages,
+        vmalloc_stats.deferred_frees);
+
+    page_fault_stats_t fault_stats = page_fault_get_stats();
+    kprintf(
+        "\n[*] Page faults: %d anonymous, %d zero page, %d file (%d pages mapped around)",
+        fault_stats.anonymous_faults,
+        fault_stats.zero_page_faults,
+        fault_stats.file_faults,
+        fault_stats.fault_around_pages);
+    kprintf(
+        "\n[*] Copy-on-write: %d pages copied, %d pages reused",
+        fault_stats.cow_copies,
+        fault_stats.cow_reuses);
 }
 
 void memstat_init_cmds()
@@ -64,4 +409,9 @@ void memstat_init_cmds()
     kshell_register_command("memstat", "Show memory statistics", _memstat_print_stats);
     kshell_register_command("alloc", "Allocate memory", _alloc);
     kshell_register_command("free", "Free memory", _free);
+    kshell_register_command("compact", "Defragment physical memory", _compact);
+    kshell_register_command("huge", "Test huge frame allocations and reserves", _huge);
+    kshell_register_command("slabinfo", "Show object cache statistics", _slabinfo);
+    kshell_register_command("color", "Toggle or benchmark page coloring", _color);
+    kshell_register_command("heapprof", "Profile heap allocations by call site", _heapprof);
 }
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/acpi.h>
+#include <kernel/arch/pc/cpu.h>
+#include <kernel/debug.h>
+#include <kernel/init.h>
+#include <kernel/memory/numa.h>
+#include <stdbool.h>
+
+/*
+ * System Resource Affinity Table entries.
+ * See the ACPI Specification 6.5, Section 5.2.16.
+ */
+#define SRAT_PROCESSOR_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+#define SRAT_ENABLED (1 << 0)
+
+typedef struct
+{
+    acpi_sdt_header_t header;
+    uint32_t table_revision;
+    uint64_t reserved;
+} __attribute__((packed)) srat_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) srat_entry_t;
+
+typedef struct
+{
+    srat_entry_t entry;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_processor_affinity_t;
+
+typedef struct
+{
+    srat_entry_t entry;
+    uint32_t proximity_domain;
+    uint16_t reserved;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) srat_memory_affinity_t;
+
+typedef struct
+{
+    srat_entry_t entry;
+    uint16_t reserved;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) srat_x2apic_affinity_t;
+
+/*
+ * System Locality Information Table.
+ * See the ACPI Specification 6.5, Section 5.2.17.
+ */
+typedef struct
+{
+    acpi_sdt_header_t header;
+    uint64_t locality_count;
+    uint8_t distances[];
+} __attribute__((packed)) slit_t;
+
+typedef struct
+{
+    uint32_t apic_id;
+    uint8_t node;
+} numa_cpu_t;
+
+/* Only needed while the PMM is set up */
+static numa_range_t __initdata _ranges[NUMA_MAX_RANGES];
+static size_t __initdata _range_count = 0;
+static uint32_t __initdata _node_domains[NUMA_MAX_NODES];
+static size_t _node_count = 0;
+static uint8_t _distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static numa_cpu_t _cpus[MAX_CPUS];
+static size_t _cpu_count = 0;
+
+/*
+ * Returns the node of an ACPI proximity domain, creating it if needed.
+ */
+static uint8_t __init _domain_to_node(uint32_t domain)
+{
+    for (size_t node = 0; node < _node_count; node++) {
+        if (_node_domains[node] == domain)
+            return node;
+    }
+    if (_node_count == NUMA_MAX_NODES) {
+        debug_log_fmt("[!] Too many NUMA nodes, domain %d is merged into node 0\n", domain);
+        return 0;
+    }
+    _node_domains[_node_count] = domain;
+    return _node_count++;
+}
+
+static void __init _add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    if (_cpu_count == MAX_CPUS)
+        return;
+    _cpus[_cpu_count++] = (numa_cpu_t) {.apic_id = apic_id, .node = _domain_to_node(domain)};
+}
+
+static void __init _parse_srat(srat_t *srat)
+{
+    uint8_t *cursor = (uint8_t *) srat + sizeof(srat_t);
+    uint8_t *end = (uint8_t *) srat + srat->header.length;
+    while (cursor + sizeof(srat_entry_t) <= end) {
+        srat_entry_t *entry = (srat_entry_t *) cursor;
+        if (entry->length == 0)
+            break;
+
+        if (entry->type == SRAT_PROCESSOR_AFFINITY) {
+            srat_processor_affinity_t *cpu = (srat_processor_affinity_t *) entry;
+            uint32_t domain = cpu->proximity_domain_low | cpu->proximity_domain_high[0] << 8
+                              | cpu->proximity_domain_high[1] << 16
+                              | cpu->proximity_domain_high[2] << 24;
+            if (cpu->flags & SRAT_ENABLED)
+                _add_cpu(cpu->apic_id, domain);
+        } else if (entry->type == SRAT_X2APIC_AFFINITY) {
+            srat_x2apic_affinity_t *cpu = (srat_x2apic_affinity_t *) entry;
+            if (cpu->flags & SRAT_ENABLED)
+                _add_cpu(cpu->x2apic_id, cpu->proximity_domain);
+        } else if (entry->type == SRAT_MEMORY_AFFINITY) {
+            srat_memory_affinity_t *memory = (srat_memory_affinity_t *) entry;
+            if (memory->flags & SRAT_ENABLED && memory->length > 0) {
+                if (_range_count == NUMA_MAX_RANGES) {
+                    debug_log_fmt("[!] Too many NUMA memory ranges, ignoring 0x%x\n", memory->base);
+                } else {
+                    _ranges[_range_count++] = (numa_range_t) {
+                        .base = memory->base,
+                        .length = memory->length,
+                        .node = _domain_to_node(memory->proximity_domain),
+                    };
+                }
+            }
+        }
+        cursor += entry->length;
+    }
+}
+
+static void __init _parse_slit(slit_t *slit)
+{
+    for (size_t from = 0; from < _node_count; from++) {
+        for (size_t to = 0; to < _node_count; to++) {
+            uint64_t row = _node_domains[from];
+            uint64_t column = _node_domains[to];
+            if (row < slit->locality_count && column < slit->locality_count)
+                _distances[from][to] = slit->distances[row * slit->locality_count + column];
+        }
+    }
+}
+
+void __init numa_init()
+{
+    debug_log("[*] Reading the NUMA topology...\n");
+
+    srat_t *srat = (srat_t *) acpi_find_table("SRAT");
+    if (srat != NULL)
+        _parse_srat(srat);
+    if (_node_count == 0)
+        _node_count = 1;
+
+    for (size_t from = 0; from < _node_count; from++) {
+        for (size_t to = 0; to < _node_count; to++)
+            _distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+    }
+    slit_t *slit = (slit_t *) acpi_find_table("SLIT");
+    if (slit != NULL)
+        _parse_slit(slit);
+
+    debug_log_fmt(
+        "[+] Found %d NUMA nodes, %d memory ranges and %d processors\n",
+        _node_count,
+        _range_count,
+        _cpu_count);
+    for (size_t i = 0; i < _range_count; i++) {
+        debug_log_fmt(
+            "[*]\tNode %d: 0x%x-0x%x\n",
+            _ranges[i].node,
+            _ranges[i].base,
+            _ranges[i].base + _ranges[i].length);
+    }
+}
+
+size_t numa_get_node_count()
+{
+    return _node_count > 0 ? _node_count : 1;
+}
+
+uint8_t numa_get_distance(int from, int to)
+{
+    return _distances[from][to];
+}
+
+int numa_get_apic_node(uint32_t apic_id)
+{
+    for (size_t i = 0; i < _cpu_count; i++) {
+        if (_cpus[i].apic_id == apic_id)
+            return _cpus[i].node;
+    }
+    return 0;
+}
+
+const numa_range_t *__init numa_get_ranges(size_t *count)
+{
+    *count = _range_count;
+    return _ranges;
+}
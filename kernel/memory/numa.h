@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Maximum number of NUMA nodes and of memory ranges assigned to them.
+ */
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_RANGES 32
+
+/*
+ * Distances reported when the firmware gives no locality information, relative to
+ * a local access costing 10.
+ */
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/*
+ * A physical memory range attached to a NUMA node.
+ */
+typedef struct
+{
+    uintptr_t base;
+    size_t length;
+    uint8_t node;
+} numa_range_t;
+
+/*
+ * Read the NUMA topology from the ACPI SRAT and SLIT tables. Without them the whole
+ * machine is a single node.
+ */
+void numa_init();
+
+/*
+ * Returns the number of NUMA nodes, always at least 1.
+ */
+size_t numa_get_node_count();
+
+/*
+ * Returns the relative cost of accessing memory of a node from another node.
+ */
+uint8_t numa_get_distance(int from, int to);
+
+/*
+ * Returns the node of the processor with the given local APIC ID, or 0 if unknown.
+ */
+int numa_get_apic_node(uint32_t apic_id);
+
+/*
+ * Returns the memory ranges attached to the nodes and stores their count.
+ * The ranges are boot-only data and are gone once the init sections are freed.
+ */
+const numa_range_t *numa_get_ranges(size_t *count);
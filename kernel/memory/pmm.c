@@ -3,85 +3,415 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include <kernel/arch/pc/asm.h>
+#include <kernel/arch/pc/cpu.h>
+#include <kernel/klibc/memory.h>
+#include <kernel/memory/compact.h>
+#include <kernel/memory/numa.h>
 #include <kernel/memory/pmm.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 
-static uint8_t *_bitmap;
-static uint8_t *_bitmap_end;
-static void *_phys_memory_start;
-static size_t _bitmap_size;
-static size_t _bitmap_page_count;
+/*
+ * Free buddy block, stored in the first page of the block itself.
+ */
+typedef struct buddy_block
+{
+    struct buddy_block *next;
+    struct buddy_block *prev;
+} buddy_block_t;
+
+/*
+ * Per-CPU stack of free single pages kept in front of the buddy allocator.
+ */
+typedef struct
+{
+    size_t count;
+    size_t frames[PMM_MAGAZINE_SIZE];
+} page_magazine_t;
+
+/*
+ * Free single pages of one cache color kept for pmm_alloc_colored.
+ */
+typedef struct
+{
+    size_t count;
+    size_t frames[PMM_COLOR_BIN_SIZE];
+} color_bin_t;
+
+/*
+ * Free lists of the memory attached to a NUMA node.
+ */
+typedef struct
+{
+    buddy_block_t *free_lists[PMM_MAX_ORDER + 1];
+    size_t free_blocks[PMM_MAX_ORDER + 1];
+    size_t total_pages;
+    uint8_t fallback[NUMA_MAX_NODES]; /* Nodes to allocate from, nearest first */
+} pmm_node_t;
+
+/*
+ * Huge frames set aside for pmm_alloc_huge.
+ */
+#define HUGE_RESERVE_MAX 16
+
+typedef struct
+{
+    int order;
+    size_t target;
+    size_t count;
+    size_t frames[HUGE_RESERVE_MAX];
+} huge_reserve_t;
+
+static page_t *_pages;
+static size_t _frame_count;
+static size_t _managed_pages = 0;
 static size_t _physical_memory_size = 0;
 static size_t _allocated_pages = 0;
+static pmm_region_t _regions[PMM_MAX_REGIONS];
+static size_t _region_count = 0;
+static pmm_node_t _nodes[NUMA_MAX_NODES];
+static size_t _node_count = 1;
+static uint8_t _cpu_nodes[MAX_CPUS];
+static page_magazine_t _magazines[MAX_CPUS];
+static size_t _zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t _zero_pool_count = 0;
+static color_bin_t _color_bins[PMM_MAX_COLORS];
+static size_t _color_count = 1;
+static size_t _next_color_start = 0;
+static bool _coloring = false;
+static huge_reserve_t _huge_reserves[] = {
+    {.order = PMM_ORDER_2M, .target = PMM_HUGE_RESERVE_2M},
+    {.order = PMM_ORDER_1G, .target = PMM_HUGE_RESERVE_1G},
+};
+
+/*
+ * Returns the number of pages held by the huge frame reserves. They are not allocated,
+ * but cannot serve other allocations either.
+ */
+static size_t _huge_reserve_pages()
+{
+    size_t pages = 0;
+    for (size_t i = 0; i < sizeof(_huge_reserves) / sizeof(_huge_reserves[0]); i++)
+        pages += _huge_reserves[i].count << _huge_reserves[i].order;
+    return pages;
+}
 
 pmm_stats_t pmm_get_stats()
 {
-    return (pmm_stats_t) {
+    pmm_stats_t stats = {
         .total_memory = _physical_memory_size,
-        .total_pages = _bitmap_page_count,
+        .total_pages = _managed_pages,
         .used_pages = _allocated_pages,
-        .free_pages = _bitmap_page_count - _allocated_pages,
+        .free_pages = _managed_pages - _allocated_pages - _huge_reserve_pages(),
     };
+    stats.node_count = _node_count;
+    for (size_t node = 0; node < _node_count; node++) {
+        stats.node_total_pages[node] = _nodes[node].total_pages;
+        for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+            stats.free_blocks[order] += _nodes[node].free_blocks[order];
+            stats.node_free_pages[node] += _nodes[node].free_blocks[order] << order;
+        }
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        stats.cached_pages += _magazines[cpu].count;
+    stats.zeroed_pages = _zero_pool_count;
+    for (size_t color = 0; color < _color_count; color++)
+        stats.colored_pages += _color_bins[color].count;
+    stats.color_count = _color_count;
+    stats.coloring = _coloring;
+    stats.reserved_2m_frames = _huge_reserves[0].count;
+    stats.reserved_1g_frames = _huge_reserves[1].count;
+    return stats;
+}
+
+const pmm_region_t *pmm_get_regions(size_t *count)
+{
+    *count = _region_count;
+    return _regions;
+}
+
+static inline buddy_block_t *_frame_to_block(size_t frame)
+{
+    return vmm_get_hhdm_addr((void *) FRAME_TO_PHYS(frame));
+}
+
+static inline size_t _block_to_frame(buddy_block_t *block)
+{
+    return PHYS_TO_FRAME(vmm_get_lhdm_addr(block));
+}
+
+static void _push_block(size_t frame, int order)
+{
+    pmm_node_t *node = &_nodes[_pages[frame].node];
+    buddy_block_t *block = _frame_to_block(frame);
+    block->prev = NULL;
+    block->next = node->free_lists[order];
+    if (node->free_lists[order] != NULL)
+        node->free_lists[order]->prev = block;
+    node->free_lists[order] = block;
+    _pages[frame].order = order;
+    node->free_blocks[order]++;
+}
+
+static void _remove_block(size_t frame, int order)
+{
+    pmm_node_t *node = &_nodes[_pages[frame].node];
+    buddy_block_t *block = _frame_to_block(frame);
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        node->free_lists[order] = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    _pages[frame].order = PAGE_ORDER_NONE;
+    node->free_blocks[order]--;
+}
+
+/*
+ * Returns the smallest order whose block can hold the given number of pages.
+ */
+static inline int _order_for_pages(size_t pages)
+{
+    if (pages <= 1)
+        return 0;
+    return 64 - __builtin_clzl(pages - 1);
 }
 
-static void _mark_pages_used(size_t start_page, size_t number_of_pages)
+/*
+ * Takes a block of the given order from a node, splitting a larger block if needed.
+ * Returns the first frame of the block, or -1 if no block is available.
+ */
+static long _buddy_alloc_node(int order, pmm_node_t *node)
 {
-    for (size_t j = start_page; j < start_page + number_of_pages; j++) {
-        size_t byte_idx = j / 8;
-        size_t bit_idx = j % 8;
-        _bitmap[byte_idx] |= (1 << bit_idx);
+    int current = order;
+    while (current <= PMM_MAX_ORDER && node->free_lists[current] == NULL)
+        current++;
+    if (current > PMM_MAX_ORDER)
+        return -1;
+
+    size_t frame = _block_to_frame(node->free_lists[current]);
+    _remove_block(frame, current);
+
+    /* Give the upper halves back until the block has the requested order */
+    while (current > order) {
+        current--;
+        _push_block(frame + ((size_t) 1 << current), current);
     }
+    return frame;
 }
 
-static void *_allocate_pages(size_t start_page, size_t number_of_pages)
+/*
+ * Takes a block of the given order from the node of the calling CPU, or from the
+ * nearest node that has one.
+ * Returns the first frame of the block, or -1 if no block is available.
+ */
+static long _buddy_alloc(int order)
 {
-    void *base_addr = _phys_memory_start + start_page * PAGE_SIZE;
-    _mark_pages_used(start_page, number_of_pages);
-    _allocated_pages += number_of_pages;
-    return (void *) base_addr;
+    pmm_node_t *local = &_nodes[_cpu_nodes[cpu_get_id()]];
+    for (size_t i = 0; i < _node_count; i++) {
+        long frame = _buddy_alloc_node(order, &_nodes[local->fallback[i]]);
+        if (frame >= 0)
+            return frame;
+    }
+    return -1;
 }
 
-static inline void *_process_byte(
-    size_t byte, size_t *free_pages, size_t *start_page, size_t number_of_pages)
+/*
+ * Takes a block of the given order whose first pages end at or below a frame
+ * limit, from the nearest node that has one. Larger blocks are split keeping their
+ * lowest part, so they qualify as long as that part is below the limit.
+ * Returns the first frame of the block, or -1 if no such block is available.
+ */
+static long _buddy_alloc_below(int order, size_t pages, size_t limit)
 {
-    size_t page_index = byte * 8;
+    pmm_node_t *local = &_nodes[_cpu_nodes[cpu_get_id()]];
+    for (size_t i = 0; i < _node_count; i++) {
+        pmm_node_t *node = &_nodes[local->fallback[i]];
+        for (int current = order; current <= PMM_MAX_ORDER; current++) {
+            buddy_block_t *block = node->free_lists[current];
+            for (; block != NULL; block = block->next) {
+                size_t frame = _block_to_frame(block);
+                if (frame + pages > limit)
+                    continue;
 
-    /* Skip scanning fully free bytes */
-    if (_bitmap[byte] == 0x00) {
-        if (*free_pages == 0) {
-            *start_page = page_index;
-        }
-        *free_pages += 8;
-        if (*free_pages >= number_of_pages) {
-            return _allocate_pages(*start_page, number_of_pages);
-        } else {
-            return NULL;
+                _remove_block(frame, current);
+                while (current > order) {
+                    current--;
+                    _push_block(frame + ((size_t) 1 << current), current);
+                }
+                return frame;
+            }
         }
     }
+    return -1;
+}
 
-    for (size_t bit = 0; bit < 8 && page_index + bit < _bitmap_page_count; bit++) {
-        size_t i = page_index + bit;
-        uint8_t bit_mask = 1 << bit;
+/*
+ * Returns a naturally aligned block to the free lists, merging it with its buddy
+ * for as long as the buddy is free, of the same order and on the same node.
+ */
+static void _buddy_free(size_t frame, int order)
+{
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = frame ^ ((size_t) 1 << order);
+        if (buddy >= _frame_count || _pages[buddy].order != order
+            || _pages[buddy].node != _pages[frame].node)
+            break;
+        _remove_block(buddy, order);
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+    _push_block(frame, order);
+}
 
-        if (!(_bitmap[byte] & bit_mask)) {
-            if (*free_pages == 0) {
-                *start_page = i;
-            }
-            (*free_pages)++;
+/*
+ * Frees a run of frames of a single node by splitting it into naturally aligned blocks.
+ */
+static void _free_node_range(size_t frame, size_t count)
+{
+    while (count > 0) {
+        int order = frame == 0 ? PMM_MAX_ORDER : __builtin_ctzl(frame);
+        int count_order = 63 - __builtin_clzl(count);
+        if (order > count_order)
+            order = count_order;
+        if (order > PMM_MAX_ORDER)
+            order = PMM_MAX_ORDER;
+        _buddy_free(frame, order);
+        frame += (size_t) 1 << order;
+        count -= (size_t) 1 << order;
+    }
+}
 
-            if (*free_pages == number_of_pages) {
-                return _allocate_pages(*start_page, number_of_pages);
-            }
-        } else {
-            *free_pages = 0;
+/*
+ * Frees an arbitrary run of frames, cut at node boundaries so that no block spans
+ * two nodes.
+ */
+static void _free_range(size_t frame, size_t count)
+{
+    while (count > 0) {
+        size_t run = 1;
+        while (run < count && _pages[frame + run].node == _pages[frame].node)
+            run++;
+        _free_node_range(frame, run);
+        frame += run;
+        count -= run;
+    }
+}
+
+/*
+ * Moves a batch of single pages from the buddy allocator into a magazine.
+ */
+static void _magazine_refill(page_magazine_t *magazine)
+{
+    while (magazine->count < PMM_MAGAZINE_BATCH) {
+        long frame = _buddy_alloc(0);
+        if (frame < 0)
+            break;
+        magazine->frames[magazine->count++] = frame;
+    }
+}
+
+/*
+ * Returns up to a batch of pages from a magazine to the buddy allocator.
+ */
+static void _magazine_drain(page_magazine_t *magazine, size_t pages)
+{
+    while (pages-- > 0 && magazine->count > 0)
+        _buddy_free(magazine->frames[--magazine->count], 0);
+}
+
+/*
+ * Splits a block holding one page of every color across the color bins. Pages that
+ * do not fit in their bin go back to the buddy allocator.
+ * Returns false if no such block is free.
+ */
+static bool _color_bins_refill()
+{
+    long frame = _buddy_alloc(_order_for_pages(_color_count));
+    if (frame < 0)
+        return false;
+
+    for (size_t i = 0; i < _color_count; i++) {
+        color_bin_t *bin = &_color_bins[(frame + i) & (_color_count - 1)];
+        if (bin->count == PMM_COLOR_BIN_SIZE)
+            _buddy_free(frame + i, 0);
+        else
+            bin->frames[bin->count++] = frame + i;
+    }
+    return true;
+}
+
+/*
+ * Returns every page held in the color bins to the buddy allocator.
+ */
+static void _color_bins_drain()
+{
+    for (size_t color = 0; color < _color_count; color++) {
+        color_bin_t *bin = &_color_bins[color];
+        while (bin->count > 0)
+            _buddy_free(bin->frames[--bin->count], 0);
+    }
+}
+
+/*
+ * Flushes every per-CPU cache, the zeroed page pool and the color bins so that
+ * cached pages can coalesce again.
+ */
+static void _drain_caches()
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        _magazine_drain(&_magazines[cpu], PMM_MAGAZINE_SIZE);
+    while (_zero_pool_count > 0)
+        _buddy_free(_zero_pool[--_zero_pool_count], 0);
+    _color_bins_drain();
+}
+
+/*
+ * Moves free blocks into the huge frame reserves until they reach their target.
+ */
+static void _huge_reserve_refill()
+{
+    for (size_t i = 0; i < sizeof(_huge_reserves) / sizeof(_huge_reserves[0]); i++) {
+        huge_reserve_t *reserve = &_huge_reserves[i];
+        while (reserve->count < reserve->target && reserve->count < HUGE_RESERVE_MAX) {
+            long frame = _buddy_alloc(reserve->order);
+            if (frame < 0)
+                break;
+            reserve->frames[reserve->count++] = frame;
         }
     }
+}
+
+/*
+ * Records a usable range of physical memory. Returns the new region, or NULL if
+ * the range holds no whole page or there is no room left for it.
+ */
+static pmm_region_t *_add_region(uintptr_t base, size_t length)
+{
+    uintptr_t start = PAGE_UP(base);
+    uintptr_t end = PAGE_DOWN(base + length);
 
-    return NULL;
+    /* Never hand out the zero page, as it would be indistinguishable from NULL */
+    if (start == 0)
+        start = PAGE_SIZE;
+    if (end <= start)
+        return NULL;
+
+    if (_region_count == PMM_MAX_REGIONS) {
+        debug_log_fmt("[!] Too many memory regions, ignoring 0x%x-0x%x\n", start, end);
+        return NULL;
+    }
+    _regions[_region_count] = (pmm_region_t) {
+        .base = start,
+        .page_count = (end - start) / PAGE_SIZE,
+    };
+    return &_regions[_region_count++];
 }
 
-static const char *_get_mmap_type(int t)
+static const char *__init _get_mmap_type(int t)
 {
     switch (t) {
     case LIMINE_MEMMAP_USABLE:
@@ -105,15 +435,14 @@ static const char *_get_mmap_type(int t)
     }
 }
 
-void pmm_init(struct limine_memmap_response *mmap_response)
+void __init pmm_init(struct limine_memmap_response *mmap_response)
 {
     debug_log("[*] Initializing PMM\n");
 
     debug_log_fmt("[*] Number of memory map entries: %d\n", mmap_response->entry_count);
 
-    /* Calculate the address of the end of kernel and physical memory start address and size */
+    /* Calculate the address of the end of kernel and collect the usable regions */
     size_t kernel_end_addr = 0;
-    struct limine_memmap_entry *biggest = NULL;
     for (size_t i = 0; i < mmap_response->entry_count; i++) {
         struct limine_memmap_entry *entry = mmap_response->entries[i];
         debug_log_fmt(
@@ -129,79 +458,628 @@ void pmm_init(struct limine_memmap_response *mmap_response)
                 kernel_end_addr = entry->base + entry->length;
         }
         if (entry->type == LIMINE_MEMMAP_USABLE) {
-            if (biggest == NULL || entry->length > biggest->length) {
-                biggest = entry;
-            }
             _physical_memory_size += entry->length;
+            _add_region(entry->base, entry->length);
         }
     }
     debug_log_fmt("[*] Found %d MB of physical memory\n", _physical_memory_size / 1048576);
 
-    _bitmap = vmm_get_hhdm_addr((void *) biggest->base);
-    _bitmap_page_count = _physical_memory_size / PAGE_SIZE;
-    _bitmap_size = (_bitmap_page_count + 7) / 8; // Round up division
-    _bitmap_end = _bitmap + _bitmap_size;
-    _phys_memory_start = (void *) (((uintptr_t) vmm_get_lhdm_addr(_bitmap_end) + PAGE_SIZE - 1)
-                                   & ~(PAGE_SIZE - 1));
+    /*
+     * Frames are indexed by their physical page number, so looking up a frame is a
+     * single shift. The page array spans every frame up to the end of the kernel or
+     * the highest usable or reclaimable region, holes included, so that memory given
+     * back after boot is covered too. It is carved from the biggest usable region.
+     */
+    _frame_count = PHYS_TO_FRAME(PAGE_DOWN(kernel_end_addr));
+
+    pmm_region_t *biggest = &_regions[0];
+    for (size_t i = 1; i < _region_count; i++) {
+        if (_regions[i].page_count > biggest->page_count)
+            biggest = &_regions[i];
+    }
+    size_t page_array_pages = PAGE_UP(_frame_count * sizeof(page_t)) / PAGE_SIZE;
+    _pages = vmm_get_hhdm_addr((void *) biggest->base);
+    biggest->base += page_array_pages * PAGE_SIZE;
+    biggest->page_count -= page_array_pages;
 
-    debug_log_fmt("[*] Physical memory start: 0x%x\n", _phys_memory_start);
     debug_log_fmt("[*] End of kernel address: 0x%x\n", kernel_end_addr);
-    debug_log_fmt("[*] Bitmap address range: 0x%x-0x%x\n", _bitmap, _bitmap_end);
-    debug_log_fmt("[*] Bitmap page count: %d pages\n", _bitmap_page_count);
-    debug_log_fmt("[*] Bitmap size: %d bytes\n", _bitmap_size);
+    debug_log_fmt("[*] Page array address: 0x%x (%d pages)\n", _pages, page_array_pages);
+    debug_log_fmt("[*] Frame count: %d frames\n", _frame_count);
+
+    debug_log("[*] Building the buddy free lists...\n");
+    /* Frames start out reserved, only the usable regions are released below */
+    for (size_t i = 0; i < _frame_count; i++) {
+        _pages[i] = (page_t) {
+            .flags = PAGE_FLAG_RESERVED,
+            .order = PAGE_ORDER_NONE,
+        };
+    }
+    /* Everything is on node 0 until the NUMA topology is known */
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        _nodes[0].free_lists[order] = NULL;
+        _nodes[0].free_blocks[order] = 0;
+    }
+    for (size_t i = 0; i < _region_count; i++) {
+        debug_log_fmt(
+            "[*]\tRegion %d: 0x%x (%d pages)\n", i, _regions[i].base, _regions[i].page_count);
+        size_t first_frame = PHYS_TO_FRAME(_regions[i].base);
+        for (size_t frame = 0; frame < _regions[i].page_count; frame++)
+            _pages[first_frame + frame].flags = 0;
+        _free_range(PHYS_TO_FRAME(_regions[i].base), _regions[i].page_count);
+        _managed_pages += _regions[i].page_count;
+    }
+    _nodes[0].total_pages = _managed_pages;
 
-    debug_log("[*] Initializing the bitmap...\n");
-    for (size_t i = 0; i < _bitmap_size; i++)
-        _bitmap[i] = 0;
+    _huge_reserve_refill();
+    debug_log_fmt(
+        "[*] Reserved %d 2 MiB frames and %d 1 GiB frames\n",
+        _huge_reserves[0].count,
+        _huge_reserves[1].count);
+
+    /*
+     * Pages whose addresses differ by a multiple of the size of one cache way share
+     * the same cache sets. That size divided by the page size is the number of page
+     * colors, kept to a power of two so that a color is the low bits of a frame.
+     */
+    cpu_cache_info_t llc;
+    if (cpu_get_llc_info(&llc)) {
+        size_t colors = llc.sets * llc.line_size / PAGE_SIZE;
+        while (_color_count * 2 <= colors && _color_count < PMM_MAX_COLORS)
+            _color_count *= 2;
+        debug_log_fmt(
+            "[*] L%d cache: %d KB, %d-way, %d page colors\n",
+            llc.level,
+            llc.size / 1024,
+            llc.ways,
+            _color_count);
+    }
 
     debug_log("[+] PMM initialized\n");
 }
 
-void *pmm_alloc(size_t pages)
+void __init pmm_numa_init()
 {
-    size_t current_free_pages = 0;
-    size_t start_page = 0;
-    void *result = NULL;
+    _node_count = numa_get_node_count();
+    _cpu_nodes[cpu_get_id()] = numa_get_apic_node(cpu_get_apic_id());
+
+    /* Each node falls back on the other nodes by increasing distance */
+    for (size_t node = 0; node < _node_count; node++) {
+        uint8_t *fallback = _nodes[node].fallback;
+        for (size_t other = 0; other < _node_count; other++) {
+            size_t i = other;
+            uint8_t distance = numa_get_distance(node, other);
+            while (i > 0 && numa_get_distance(node, fallback[i - 1]) > distance) {
+                fallback[i] = fallback[i - 1];
+                i--;
+            }
+            fallback[i] = other;
+        }
+    }
+    if (_node_count == 1)
+        return;
 
-    for (size_t byte = 0; byte < _bitmap_size; byte++) {
-        /* Skip fully used bytes */
-        if (_bitmap[byte] == 0xFF) {
-            current_free_pages = 0;
+    /* Take every free block out of node 0, then free them again on their own node */
+    _drain_caches();
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        _nodes[0].free_lists[order] = NULL;
+        _nodes[0].free_blocks[order] = 0;
+    }
+    for (size_t frame = 0; frame < _frame_count; frame++) {
+        page_t *page = &_pages[frame];
+        if (page->order == PAGE_ORDER_NONE)
             continue;
+        for (size_t i = 0; i < ((size_t) 1 << page->order); i++)
+            _pages[frame + i].flags |= PAGE_FLAG_ISOLATED;
+        page->order = PAGE_ORDER_NONE;
+    }
+
+    size_t range_count;
+    const numa_range_t *ranges = numa_get_ranges(&range_count);
+    for (size_t i = 0; i < range_count; i++) {
+        size_t first_frame = PHYS_TO_FRAME(PAGE_UP(ranges[i].base));
+        size_t end_frame = PHYS_TO_FRAME(ranges[i].base + ranges[i].length);
+        for (size_t frame = first_frame; frame < end_frame && frame < _frame_count; frame++)
+            _pages[frame].node = ranges[i].node;
+    }
+
+    _nodes[0].total_pages = 0;
+    for (size_t frame = 0; frame < _frame_count; frame++) {
+        if (!(_pages[frame].flags & PAGE_FLAG_RESERVED))
+            _nodes[_pages[frame].node].total_pages++;
+    }
+    pmm_release_isolated(0, _frame_count);
+
+    for (size_t node = 0; node < _node_count; node++)
+        debug_log_fmt("[*] NUMA node %d: %d pages\n", node, _nodes[node].total_pages);
+}
+
+void pmm_add_range(uintptr_t base, size_t length)
+{
+    if (PHYS_TO_FRAME(PAGE_DOWN(base + length)) > _frame_count) {
+        debug_log_fmt("[!] pmm_add_range: 0x%x-0x%x is not covered\n", base, base + length);
+        return;
+    }
+
+    pmm_region_t *region = _add_region(base, length);
+    if (region == NULL)
+        return;
+
+    size_t first_frame = PHYS_TO_FRAME(region->base);
+    for (size_t frame = 0; frame < region->page_count; frame++) {
+        _pages[first_frame + frame].flags = 0;
+        _nodes[_pages[first_frame + frame].node].total_pages++;
+    }
+    _free_range(first_frame, region->page_count);
+    _managed_pages += region->page_count;
+    _physical_memory_size += region->page_count * PAGE_SIZE;
+}
+
+void __init pmm_reclaim(struct limine_memmap_response *mmap_response)
+{
+    /* The memory map itself lives in the memory being reclaimed, copy it out first */
+    pmm_region_t ranges[PMM_MAX_REGIONS];
+    size_t range_count = 0;
+    uintptr_t stack = (uintptr_t) vmm_get_lhdm_addr((void *) asm_read_rsp());
+    for (size_t i = 0; i < mmap_response->entry_count && range_count < PMM_MAX_REGIONS; i++) {
+        struct limine_memmap_entry *entry = mmap_response->entries[i];
+        if (entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+            continue;
+        /* kmain keeps running on the stack given by the bootloader */
+        if (stack >= entry->base && stack < entry->base + entry->length)
+            continue;
+        ranges[range_count++] = (pmm_region_t) {
+            .base = entry->base,
+            .page_count = entry->length / PAGE_SIZE,
+        };
+    }
+
+    size_t reclaimed_pages = _managed_pages;
+    for (size_t i = 0; i < range_count; i++)
+        pmm_add_range(ranges[i].base, ranges[i].page_count * PAGE_SIZE);
+    reclaimed_pages = _managed_pages - reclaimed_pages;
+    debug_log_fmt("[+] Reclaimed %d KB of bootloader memory\n", reclaimed_pages * PAGE_SIZE / 1024);
+}
+
+/*
+ * Takes a run of frames from the caches or the buddy allocator without accounting.
+ * Returns the first frame of the run, or -1 if no run is available.
+ */
+static long _alloc_frames(size_t pages)
+{
+    /* Single pages are served from the local cache whenever possible */
+    if (pages == 1) {
+        page_magazine_t *magazine = &_magazines[cpu_get_id()];
+        if (magazine->count == 0)
+            _magazine_refill(magazine);
+        if (magazine->count > 0)
+            return magazine->frames[--magazine->count];
+    }
+
+    int order = _order_for_pages(pages);
+    if (order > PMM_MAX_ORDER)
+        return -1;
+
+    long frame = _buddy_alloc(order);
+    if (frame < 0) {
+        /* Cached pages may be what keeps larger blocks from forming */
+        _drain_caches();
+        frame = _buddy_alloc(order);
+        if (frame < 0)
+            return -1;
+    }
+
+    /* Hand back the tail of the block that was not asked for */
+    size_t block_pages = (size_t) 1 << order;
+    if (block_pages > pages)
+        _free_range(frame + pages, block_pages - pages);
+    return frame;
+}
+
+/*
+ * Gives the allocation reference of a run of frames to the caller.
+ */
+static void *_claim_frames(size_t frame, size_t pages)
+{
+    for (size_t i = 0; i < pages; i++)
+        _pages[frame + i].refcount = 1;
+    _allocated_pages += pages;
+    return (void *) FRAME_TO_PHYS(frame);
+}
+
+void *pmm_alloc(size_t pages)
+{
+    return pmm_alloc_flags(pages, 0);
+}
+
+void *pmm_alloc_flags(size_t pages, int flags)
+{
+    if (pages == 0)
+        return NULL;
+
+    long frame = _alloc_frames(pages);
+    if (frame < 0 && pages > 1 && (flags & PMM_ALLOC_COMPACT)
+        && compact_memory(_order_for_pages(pages), 1) > 0)
+        frame = _alloc_frames(pages);
+    if (frame < 0) {
+        debug_log_fmt("[-] pmm_alloc failed: Could not find %d contiguous pages\n", pages);
+        return NULL;
+    }
+
+    return _claim_frames(frame, pages);
+}
+
+/*
+ * Takes a run of frames starting on a given color without accounting.
+ * Returns the first frame of the run, or -1 if no such run is available.
+ */
+static long _alloc_colored_frames(size_t pages, size_t color)
+{
+    if (pages == 1) {
+        color_bin_t *bin = &_color_bins[color];
+        if (bin->count == 0 && !_color_bins_refill())
+            return -1;
+        return bin->frames[--bin->count];
+    }
+
+    /* Take enough pages for the run to start on any color, then trim both ends */
+    size_t extra = _color_count - 1;
+    long frame = _alloc_frames(pages + extra);
+    if (frame < 0)
+        return -1;
+
+    size_t head = (color - frame) & (_color_count - 1);
+    _free_range(frame, head);
+    _free_range(frame + head + pages, extra - head);
+    return frame + head;
+}
+
+void *pmm_alloc_colored(size_t pages, pmm_color_t *color)
+{
+    if (!_coloring || color == NULL || pages == 0)
+        return pmm_alloc(pages);
+
+    /* Coloring is best effort, a page of any color beats no page */
+    long frame = _alloc_colored_frames(pages, color->next);
+    if (frame < 0)
+        return pmm_alloc(pages);
+
+    color->next = (color->next + pages) & (_color_count - 1);
+    return _claim_frames(frame, pages);
+}
+
+void *pmm_alloc_colored_zeroed(size_t pages, pmm_color_t *color)
+{
+    /* The pre-zeroed pool does not sort its pages by color */
+    if (!_coloring || color == NULL)
+        return pmm_alloc_zeroed(pages);
+
+    void *phys = pmm_alloc_colored(pages, color);
+    if (phys != NULL)
+        memset(vmm_get_hhdm_addr(phys), 0, pages * PAGE_SIZE);
+    return phys;
+}
+
+void pmm_color_init(pmm_color_t *color)
+{
+    /* An odd step visits every color before a start color is reused */
+    color->next = _next_color_start;
+    _next_color_start = (_next_color_start + 37) & (_color_count - 1);
+}
+
+void pmm_set_coloring(bool enabled)
+{
+    if (!enabled)
+        _color_bins_drain();
+    _coloring = enabled;
+}
+
+size_t pmm_get_color(uintptr_t phys)
+{
+    return PHYS_TO_FRAME(phys) & (_color_count - 1);
+}
+
+void *pmm_alloc_huge(int order)
+{
+    if (order < 0 || order > PMM_MAX_ORDER) {
+        debug_log_fmt("[!] pmm_alloc_huge: Invalid order %d\n", order);
+        return NULL;
+    }
+
+    long frame = _buddy_alloc(order);
+    if (frame < 0) {
+        _drain_caches();
+        frame = _buddy_alloc(order);
+    }
+    if (frame < 0) {
+        for (size_t i = 0; i < sizeof(_huge_reserves) / sizeof(_huge_reserves[0]); i++) {
+            huge_reserve_t *reserve = &_huge_reserves[i];
+            if (reserve->order == order && reserve->count > 0) {
+                frame = reserve->frames[--reserve->count];
+                break;
+            }
         }
+    }
+    if (frame < 0) {
+        debug_log_fmt("[-] pmm_alloc_huge failed: No free block of order %d\n", order);
+        return NULL;
+    }
+
+    return _claim_frames(frame, (size_t) 1 << order);
+}
 
-        result = _process_byte(byte, &current_free_pages, &start_page, pages);
-        if (result) {
-            return result;
+long pmm_set_huge_reserve(int order, size_t count)
+{
+    for (size_t i = 0; i < sizeof(_huge_reserves) / sizeof(_huge_reserves[0]); i++) {
+        huge_reserve_t *reserve = &_huge_reserves[i];
+        if (reserve->order != order)
+            continue;
+
+        reserve->target = count < HUGE_RESERVE_MAX ? count : HUGE_RESERVE_MAX;
+        while (reserve->count > reserve->target)
+            _buddy_free(reserve->frames[--reserve->count], order);
+        _huge_reserve_refill();
+        return reserve->count;
+    }
+    return -1;
+}
+
+void *pmm_alloc_constrained(size_t pages, uintptr_t max_phys, size_t align)
+{
+    if (pages == 0 || align == 0 || (align & (align - 1)) != 0) {
+        debug_log_fmt("[!] pmm_alloc_constrained: Invalid request of %d pages\n", pages);
+        return NULL;
+    }
+
+    /* Blocks of the buddy allocator are aligned to their own size */
+    int order = _order_for_pages(pages);
+    int align_order = align > PAGE_SIZE ? 63 - __builtin_clzl(align / PAGE_SIZE) : 0;
+    if (align_order > order)
+        order = align_order;
+    if (order > PMM_MAX_ORDER)
+        return NULL;
+
+    size_t limit = PHYS_TO_FRAME(max_phys) + (max_phys % PAGE_SIZE == PAGE_SIZE - 1);
+    long frame = _buddy_alloc_below(order, pages, limit);
+    if (frame < 0) {
+        _drain_caches();
+        frame = _buddy_alloc_below(order, pages, limit);
+    }
+    if (frame < 0) {
+        debug_log_fmt(
+            "[-] pmm_alloc_constrained failed: No %d pages below 0x%x\n", pages, max_phys);
+        return NULL;
+    }
+
+    /* Hand back the tail of the block that was not asked for */
+    size_t block_pages = (size_t) 1 << order;
+    if (block_pages > pages)
+        _free_range(frame + pages, block_pages - pages);
+    return _claim_frames(frame, pages);
+}
+
+void *pmm_alloc_zeroed(size_t pages)
+{
+    if (pages == 1 && _zero_pool_count > 0)
+        return _claim_frames(_zero_pool[--_zero_pool_count], 1);
+
+    void *phys = pmm_alloc(pages);
+    if (phys != NULL)
+        memset(vmm_get_hhdm_addr(phys), 0, pages * PAGE_SIZE);
+    return phys;
+}
+
+/*
+ * Gives a run of frames whose last reference was dropped back to the allocator.
+ */
+static void _release_frames(size_t frame, size_t pages)
+{
+    if (pages == 0)
+        return;
+
+    _allocated_pages -= pages;
+    if (pages == 1) {
+        page_magazine_t *magazine = &_magazines[cpu_get_id()];
+        if (magazine->count == PMM_MAGAZINE_SIZE)
+            _magazine_drain(magazine, PMM_MAGAZINE_BATCH);
+        magazine->frames[magazine->count++] = frame;
+        return;
+    }
+
+    _free_range(frame, pages);
+}
+
+/*
+ * Checks that a physical range is page-aligned and covered by the page array.
+ */
+static bool _check_range(const char *caller, uintptr_t phys, size_t pages)
+{
+    if (phys % PAGE_SIZE != 0) {
+        debug_log_fmt("[!] %s: Pointer 0x%x is not page-aligned\n", caller, phys);
+        return false;
+    }
+    if (PHYS_TO_FRAME(phys) + pages > _frame_count) {
+        debug_log_fmt("[!] %s: %d pages at 0x%x exceed memory\n", caller, pages, phys);
+        return false;
+    }
+    return true;
+}
+
+page_t *page_lookup(uintptr_t phys)
+{
+    size_t frame = PHYS_TO_FRAME(phys);
+    if (frame >= _frame_count || _pages[frame].flags & PAGE_FLAG_RESERVED)
+        return NULL;
+    return &_pages[frame];
+}
+
+void page_get(uintptr_t phys, size_t pages, bool mapping)
+{
+    /* Memory the PMM does not manage, like the framebuffer, is not counted */
+    if (PHYS_TO_FRAME(phys) >= _frame_count || !_check_range("page_get", phys, pages))
+        return;
+
+    for (size_t frame = PHYS_TO_FRAME(phys); frame < PHYS_TO_FRAME(phys) + pages; frame++) {
+        page_t *page = &_pages[frame];
+        if (page->flags & PAGE_FLAG_RESERVED)
+            continue;
+        if (page->refcount == 0) {
+            debug_log_fmt("[!] page_get: Page 0x%x is free\n", FRAME_TO_PHYS(frame));
+            continue;
         }
+        page->refcount++;
+        if (mapping)
+            page->map_count++;
     }
+}
+
+void page_put(uintptr_t phys, size_t pages, bool mapping)
+{
+    if (PHYS_TO_FRAME(phys) >= _frame_count || !_check_range("page_put", phys, pages))
+        return;
 
-    debug_log_fmt("[-] pmm_alloc failed: Could not find %d contiguous pages\n", pages);
-    return NULL;
+    /* Pages are released in runs, so that whole blocks go back to the buddy allocator */
+    size_t run_start = PHYS_TO_FRAME(phys);
+    size_t run_length = 0;
+    for (size_t frame = PHYS_TO_FRAME(phys); frame < PHYS_TO_FRAME(phys) + pages; frame++) {
+        page_t *page = &_pages[frame];
+        if (page->flags & PAGE_FLAG_RESERVED) {
+            /* Skipped below */
+        } else if (page->refcount == 0) {
+            debug_log_fmt("[!] page_put: Page 0x%x is already free\n", FRAME_TO_PHYS(frame));
+        } else {
+            if (mapping && page->map_count > 0)
+                page->map_count--;
+            if (--page->refcount == 0) {
+                if (!(page->flags & PAGE_FLAG_ISOLATED)) {
+                    run_length++;
+                    continue;
+                }
+                /* Isolated pages stay out of the allocator until compaction is done */
+                _allocated_pages--;
+            }
+        }
+        _release_frames(run_start, run_length);
+        run_start = frame + 1;
+        run_length = 0;
+    }
+    _release_frames(run_start, run_length);
 }
 
 void pmm_free(void *ptr, size_t pages)
 {
     if (ptr == NULL)
         return;
-
-    uintptr_t base_addr = (uint64_t) ptr;
-    if (base_addr % PAGE_SIZE != 0) {
-        debug_log_fmt("[!] pmm_free: Pointer 0x%x is not page-aligned\n", base_addr);
+    if (!_check_range("pmm_free", (uintptr_t) ptr, pages))
         return;
+
+    page_put((uintptr_t) ptr, pages, false);
+}
+
+void pmm_idle()
+{
+    _huge_reserve_refill();
+
+    for (int i = 0; i < PMM_ZERO_POOL_BATCH && _zero_pool_count < PMM_ZERO_POOL_SIZE; i++) {
+        long frame = _alloc_frames(1);
+        if (frame < 0)
+            return;
+        asm_zero_page_nt(vmm_get_hhdm_addr((void *) FRAME_TO_PHYS(frame)));
+        _zero_pool[_zero_pool_count++] = frame;
     }
-    size_t start_page = (base_addr - (uintptr_t) _phys_memory_start) / PAGE_SIZE;
-    if (start_page + pages > _bitmap_page_count) {
-        debug_log_fmt("[!] pmm_free: Freeing %d pages at 0x%x exceeds bitmap\n", pages, base_addr);
-        return;
+}
+
+int pmm_fragmentation_index(int order)
+{
+    if (order < 0 || order > PMM_MAX_ORDER)
+        return 0;
+
+    size_t free_pages = _managed_pages - _allocated_pages - _huge_reserve_pages();
+    if (free_pages == 0)
+        return 0;
+
+    size_t usable_pages = 0;
+    for (size_t node = 0; node < _node_count; node++) {
+        for (int current = order; current <= PMM_MAX_ORDER; current++)
+            usable_pages += _nodes[node].free_blocks[current] << current;
+    }
+    return (free_pages - usable_pages) * 100 / free_pages;
+}
+
+bool pmm_is_free(uintptr_t phys)
+{
+    page_t *page = page_lookup(phys);
+    if (page == NULL || page->refcount > 0 || page->flags & PAGE_FLAG_ISOLATED)
+        return false;
+
+    /* Reserved huge frames have no reference but are not the allocator's to hand out */
+    size_t frame = PHYS_TO_FRAME(phys);
+    for (size_t i = 0; i < sizeof(_huge_reserves) / sizeof(_huge_reserves[0]); i++) {
+        huge_reserve_t *reserve = &_huge_reserves[i];
+        size_t block_pages = (size_t) 1 << reserve->order;
+        for (size_t j = 0; j < reserve->count; j++) {
+            if (frame >= reserve->frames[j] && frame < reserve->frames[j] + block_pages)
+                return false;
+        }
     }
+    return true;
+}
+
+void pmm_isolate_range(uintptr_t base, size_t pages)
+{
+    if (!_check_range("pmm_isolate_range", base, pages))
+        return;
+
+    /* Cached pages are not in the free lists, put them back so they get isolated too */
+    _drain_caches();
 
-    /* Mark the pages as free */
-    for (size_t i = start_page; i < start_page + pages; i++) {
-        size_t byte_idx = i / 8;
-        size_t bit_idx = i % 8;
-        _bitmap[byte_idx] &= ~(1 << bit_idx);
+    /*
+     * Only used pages and free blocks that fit in the range are isolated. Pages the
+     * allocator does not own right now, like the huge frame reserve, are left alone.
+     */
+    size_t frame = PHYS_TO_FRAME(base);
+    size_t end = frame + pages;
+    while (frame < end) {
+        page_t *page = &_pages[frame];
+        if (page->order != PAGE_ORDER_NONE) {
+            size_t block_pages = (size_t) 1 << page->order;
+            if (frame + block_pages > end) {
+                frame += block_pages;
+                continue;
+            }
+            _remove_block(frame, page->order);
+            for (size_t i = 0; i < block_pages; i++)
+                _pages[frame + i].flags |= PAGE_FLAG_ISOLATED;
+            frame += block_pages;
+            continue;
+        }
+        if (page->refcount > 0)
+            page->flags |= PAGE_FLAG_ISOLATED;
+        frame++;
     }
+}
 
-    _allocated_pages -= pages;
+void pmm_release_isolated(uintptr_t base, size_t pages)
+{
+    if (!_check_range("pmm_release_isolated", base, pages))
+        return;
+
+    size_t run_start = PHYS_TO_FRAME(base);
+    size_t run_length = 0;
+    for (size_t frame = PHYS_TO_FRAME(base); frame < PHYS_TO_FRAME(base) + pages; frame++) {
+        page_t *page = &_pages[frame];
+        if (page->flags & PAGE_FLAG_ISOLATED) {
+            page->flags &= ~PAGE_FLAG_ISOLATED;
+            /* Pages still in use keep their owner */
+            if (page->refcount == 0) {
+                run_length++;
+                continue;
+            }
+        }
+        if (run_length > 0)
+            _free_range(run_start, run_length);
+        run_start = frame + 1;
+        run_length = 0;
+    }
+    if (run_length > 0)
+        _free_range(run_start, run_length);
 }
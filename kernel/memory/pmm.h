@@ -5,8 +5,11 @@
 
 #pragma once
 
+#include <kernel/memory/numa.h>
 #include <libs/limine/limine.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define PAGE_SIZE 4096
 
@@ -20,6 +23,102 @@
  */
 #define PAGE_DOWN(x) ((x) & ~(PAGE_SIZE - 1))
 
+/*
+ * Largest block order handed out by the buddy allocator (2^18 pages, 1 GiB).
+ */
+#define PMM_MAX_ORDER 18
+
+/*
+ * Orders of the blocks backing 2 MiB and 1 GiB pages.
+ */
+#define PMM_ORDER_2M 9
+#define PMM_ORDER_1G 18
+
+/*
+ * Number of 2 MiB and 1 GiB frames set aside at boot for pmm_alloc_huge, so that
+ * huge frames can still be found once physical memory is fragmented.
+ * At most 16 frames of each size can be reserved. Reserved frames serve nothing else,
+ * so none are kept by default. The huge shell command changes the targets at runtime.
+ */
+#define PMM_HUGE_RESERVE_2M 0
+#define PMM_HUGE_RESERVE_1G 0
+
+/*
+ * Maximum number of usable memory map regions tracked by the PMM.
+ */
+#define PMM_MAX_REGIONS 64
+
+/*
+ * Capacity of each per-CPU single page cache, and the number of pages moved
+ * between a cache and the buddy allocator at once.
+ */
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+/*
+ * Capacity of the pool of pre-zeroed pages, and the number of pages zeroed each
+ * time the CPU goes idle.
+ */
+#define PMM_ZERO_POOL_SIZE 256
+#define PMM_ZERO_POOL_BATCH 16
+
+/*
+ * Maximum number of last level cache colors used by pmm_alloc_colored, and the
+ * number of free pages of each color kept ready for single page allocations.
+ */
+#define PMM_MAX_COLORS 256
+#define PMM_COLOR_BIN_SIZE 4
+
+/*
+ * Converts a physical address to its page frame number and back.
+ */
+#define PHYS_TO_FRAME(addr) ((uintptr_t) (addr) / PAGE_SIZE)
+#define FRAME_TO_PHYS(frame) ((uintptr_t) (frame) * PAGE_SIZE)
+
+/*
+ * Order stored in the metadata of frames that do not start a free buddy block.
+ */
+#define PAGE_ORDER_NONE 0xFF
+
+/*
+ * Page frame flags.
+ */
+#define PAGE_FLAG_RESERVED (1 << 0) /* Not managed by the PMM (hole, firmware, MMIO) */
+#define PAGE_FLAG_PINNED (1 << 1)   /* Must stay at its physical address */
+#define PAGE_FLAG_ISOLATED (1 << 2) /* Held back from the allocator by compaction */
+
+/*
+ * Metadata kept for every physical page frame, indexed by frame number.
+ * Kept at 8 bytes so that the whole array costs 0.2% of the memory it describes.
+ */
+typedef struct
+{
+    uint16_t refcount;  /* References held on the page, 0 when it is free */
+    uint16_t map_count; /* Number of task mappings of the page */
+    uint16_t flags;     /* PAGE_FLAG_* */
+    uint8_t order;      /* Order of the free block starting here, or PAGE_ORDER_NONE */
+    uint8_t node;       /* NUMA node the frame belongs to */
+} page_t;
+
+/*
+ * Color cursor of a task or subsystem. Consecutive allocations made through the same
+ * cursor start on consecutive cache colors, so that they do not compete for the same
+ * last level cache sets.
+ */
+typedef struct
+{
+    size_t next; /* Color of the next page to allocate */
+} pmm_color_t;
+
+/*
+ * A usable physical memory region taken from the bootloader memory map.
+ */
+typedef struct
+{
+    uintptr_t base;    /* Physical address of the first managed page */
+    size_t page_count; /* Number of pages managed in this region */
+} pmm_region_t;
+
 /*
  * Physical memory statistics and information.
  */
@@ -27,8 +126,19 @@ typedef struct
 {
     size_t total_memory;
     size_t total_pages;
-    size_t free_pages;
+    size_t free_pages;                     /* Reserved huge frames are not counted */
     size_t used_pages;
+    size_t cached_pages;                   /* Free pages held in per-CPU caches */
+    size_t zeroed_pages;                   /* Free pages held in the pre-zeroed pool */
+    size_t colored_pages;                  /* Free pages held in the color bins */
+    size_t color_count;                    /* Page colors of the last level cache */
+    bool coloring;                         /* Whether pmm_alloc_colored spreads colors */
+    size_t reserved_2m_frames;             /* 2 MiB frames held in the huge reserve */
+    size_t reserved_1g_frames;             /* 1 GiB frames held in the huge reserve */
+    size_t free_blocks[PMM_MAX_ORDER + 1]; /* Free buddy blocks per order */
+    size_t node_count;
+    size_t node_total_pages[NUMA_MAX_NODES]; /* Managed pages per NUMA node */
+    size_t node_free_pages[NUMA_MAX_NODES];  /* Pages in the free lists per NUMA node */
 } pmm_stats_t;
 
 /*
@@ -36,11 +146,34 @@ typedef struct
  */
 pmm_stats_t pmm_get_stats();
 
+/*
+ * Returns the usable memory regions managed by the PMM and stores their count.
+ */
+const pmm_region_t *pmm_get_regions(size_t *count);
+
 /*
  * Initialize the Physical Memory Manager.
  */
 void pmm_init(struct limine_memmap_response *);
 
+/*
+ * Split the free memory into per-node pools once the NUMA topology is known.
+ * Allocations are then served from the node of the calling CPU first.
+ */
+void pmm_numa_init();
+
+/*
+ * Give a physical range that was not usable at boot to the PMM.
+ * The range must lie below the end of the highest region known at boot.
+ */
+void pmm_add_range(uintptr_t base, size_t length);
+
+/*
+ * Give the bootloader reclaimable memory to the PMM, except for the region holding
+ * the current stack. Any bootloader response still needed must be copied out first.
+ */
+void pmm_reclaim(struct limine_memmap_response *);
+
 /*
  * Allocate free pages from physical memory.
  * Returns a pointer to the allocated page if successful, otherwise NULL.
@@ -48,7 +181,131 @@ void pmm_init(struct limine_memmap_response *);
 void *pmm_alloc(size_t pages);
 
 /*
- * Free a page of physical memory.
+ * Flags of pmm_alloc_flags.
+ */
+#define PMM_ALLOC_COMPACT (1 << 0) /* Compact memory if no free block is big enough */
+
+/*
+ * Allocate free pages from physical memory like pmm_alloc. Compaction moves the pages
+ * of user tasks around and may take long, so PMM_ALLOC_COMPACT is only for callers
+ * running with interrupts enabled and no lock held, never for the heap.
+ * Returns a pointer to the allocated page if successful, otherwise NULL.
+ */
+void *pmm_alloc_flags(size_t pages, int flags);
+
+/*
+ * Allocate free pages from physical memory, filled with zeroes.
+ * Single pages are taken from the pre-zeroed pool when it is not empty.
+ * Returns a pointer to the allocated page if successful, otherwise NULL.
+ */
+void *pmm_alloc_zeroed(size_t pages);
+
+/*
+ * Allocate a naturally aligned block of 2^order pages, like PMM_ORDER_2M or
+ * PMM_ORDER_1G. Falls back to the frames reserved at boot when no free block of
+ * that size is left. The block is freed with pmm_free.
+ * Returns the physical address of the block if successful, otherwise NULL.
+ */
+void *pmm_alloc_huge(int order);
+
+/*
+ * Set how many frames of a huge order (PMM_ORDER_2M or PMM_ORDER_1G) are kept in
+ * reserve for pmm_alloc_huge, up to 16. The reserve is filled or emptied right away
+ * as far as free memory allows, and topped up by pmm_idle afterwards.
+ * Returns the number of frames now held, or -1 if the order has no reserve.
+ */
+long pmm_set_huge_reserve(int order, size_t count);
+
+/*
+ * Allocate contiguous free pages that end at or below max_phys and start on an align
+ * boundary, which must be a power of two. Meant for devices that cannot reach all of
+ * physical memory. The pages are freed with pmm_free.
+ * Returns the physical address of the first page if successful, otherwise NULL.
+ */
+void *pmm_alloc_constrained(size_t pages, uintptr_t max_phys, size_t align);
+
+/*
+ * Allocate free pages starting on the next color of a cursor and advance the cursor
+ * past them. Behaves like pmm_alloc when page coloring is disabled or when no page
+ * of the wanted color is left. The pages are freed with pmm_free.
+ * Returns a pointer to the allocated page if successful, otherwise NULL.
+ */
+void *pmm_alloc_colored(size_t pages, pmm_color_t *color);
+
+/*
+ * Allocate free pages like pmm_alloc_colored, filled with zeroes. Behaves like
+ * pmm_alloc_zeroed when page coloring is disabled.
+ * Returns a pointer to the allocated page if successful, otherwise NULL.
+ */
+void *pmm_alloc_colored_zeroed(size_t pages, pmm_color_t *color);
+
+/*
+ * Start a color cursor. Cursors started one after the other begin on colors far
+ * apart from each other.
+ */
+void pmm_color_init(pmm_color_t *color);
+
+/*
+ * Turn the page coloring mode on or off. It is off at boot.
+ */
+void pmm_set_coloring(bool enabled);
+
+/*
+ * Returns the last level cache color of a physical address.
+ */
+size_t pmm_get_color(uintptr_t phys);
+
+/*
+ * Free pages of physical memory previously returned by pmm_alloc.
+ * This drops the allocation reference, pages still referenced elsewhere stay in use.
  * Does nothing if the parameter is NULL.
  */
 void pmm_free(void *, size_t);
+
+/*
+ * Refill the pre-zeroed page pool a little and top up the huge frame reserve.
+ * Meant to be called from idle loops.
+ */
+void pmm_idle();
+
+/*
+ * Returns the metadata of the page frame holding a physical address, or NULL if
+ * the frame is not managed by the PMM.
+ */
+page_t *page_lookup(uintptr_t phys);
+
+/*
+ * Take a reference on every page of a physical range. References taken for a
+ * mapping also count towards the map count of the pages.
+ * Pages not managed by the PMM are ignored.
+ */
+void page_get(uintptr_t phys, size_t pages, bool mapping);
+
+/*
+ * Drop a reference on every page of a physical range, as taken by page_get or
+ * pmm_alloc. Pages whose last reference is dropped are freed.
+ */
+void page_put(uintptr_t phys, size_t pages, bool mapping);
+
+/*
+ * Returns how fragmented free memory is for allocations of the given order, from 0
+ * when every free page can serve such an allocation to 100 when none can.
+ */
+int pmm_fragmentation_index(int order);
+
+/*
+ * Returns true if the page holding a physical address is free and can be handed out
+ * by the allocator. Frames held by the huge frame reserve are not.
+ */
+bool pmm_is_free(uintptr_t phys);
+
+/*
+ * Take the free blocks of a physical range out of the allocator, and keep pages of
+ * the range freed later out of it as well, until pmm_release_isolated is called.
+ */
+void pmm_isolate_range(uintptr_t base, size_t pages);
+
+/*
+ * Give the free pages of a range isolated by pmm_isolate_range back to the allocator.
+ */
+void pmm_release_isolated(uintptr_t base, size_t pages);
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/debug.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/slab.h>
+#include <kernel/memory/vmm.h>
+#include <stdint.h>
+
+/*
+ * Distance between the start offsets of the objects of consecutive slabs.
+ */
+#define SLAB_COLOR_STEP 64
+
+/*
+ * Header stored at the start of every slab page. Free objects are linked through
+ * their first word.
+ */
+typedef struct slab
+{
+    struct slab *next;
+    struct slab *prev;
+    kmem_cache_t *cache;
+    void *free_list;
+    size_t in_use;
+} slab_t;
+
+typedef struct
+{
+    slab_t *head;
+    size_t count;
+} slab_list_t;
+
+struct kmem_cache
+{
+    const char *name;
+    size_t object_size;
+    size_t objects_per_slab;
+    size_t first_offset; /* Offset of the first object past the slab header */
+    size_t color_range;  /* Bytes left over at the end of a slab */
+    size_t color_step;
+    size_t color_next;   /* Extra offset of the objects of the next slab */
+    void (*constructor)(void *);
+    slab_list_t partial;
+    slab_list_t full;
+    slab_list_t empty;
+    size_t active_objects;
+    size_t allocations;
+    size_t frees;
+};
+
+static kmem_cache_t _caches[SLAB_MAX_CACHES];
+static size_t _cache_count = 0;
+
+static void _slab_link(slab_list_t *list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = slab;
+    list->head = slab;
+    list->count++;
+}
+
+static void _slab_unlink(slab_list_t *list, slab_t *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        list->head = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    list->count--;
+}
+
+/*
+ * Returns the list a slab belongs on given how many of its objects are in use.
+ */
+static slab_list_t *_slab_list(kmem_cache_t *cache, slab_t *slab)
+{
+    if (slab->in_use == 0)
+        return &cache->empty;
+    if (slab->in_use == cache->objects_per_slab)
+        return &cache->full;
+    return &cache->partial;
+}
+
+static slab_t *_slab_create(kmem_cache_t *cache)
+{
+    void *phys = pmm_alloc(1);
+    if (phys == NULL)
+        return NULL;
+
+    slab_t *slab = vmm_get_hhdm_addr(phys);
+    slab->cache = cache;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+
+    /*
+     * Objects of consecutive slabs start at different cache line offsets, so that
+     * the first objects of every slab do not all compete for the same cache sets.
+     */
+    uint8_t *objects = (uint8_t *) slab + cache->first_offset + cache->color_next;
+    cache->color_next += cache->color_step;
+    if (cache->color_next > cache->color_range)
+        cache->color_next = 0;
+
+    /* Link the objects in address order */
+    for (size_t i = cache->objects_per_slab; i-- > 0;) {
+        void **object = (void **) (objects + i * cache->object_size);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+    return slab;
+}
+
+static void _slab_destroy(slab_t *slab)
+{
+    pmm_free(vmm_get_lhdm_addr(slab), 1);
+}
+
+kmem_cache_t *kmem_cache_create(
+    const char *name,
+    size_t size,
+    size_t align,
+    void (*constructor)(void *))
+{
+    if (align == 0)
+        align = sizeof(void *);
+    if ((align & (align - 1)) != 0 || align > SLAB_MAX_OBJECT_SIZE) {
+        debug_log_fmt("[!] kmem_cache_create: Invalid alignment %d for %s\n", align, name);
+        return NULL;
+    }
+
+    /* Free objects hold the free list link */
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + align - 1) & ~(align - 1);
+    if (size > SLAB_MAX_OBJECT_SIZE) {
+        debug_log_fmt("[-] kmem_cache_create: Objects of %s are too big\n", name);
+        return NULL;
+    }
+    if (_cache_count == SLAB_MAX_CACHES) {
+        debug_log_fmt("[-] kmem_cache_create: No room left for %s\n", name);
+        return NULL;
+    }
+
+    kmem_cache_t *cache = &_caches[_cache_count++];
+    *cache = (kmem_cache_t) {
+        .name = name,
+        .object_size = size,
+        .first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1),
+        .color_step = align > SLAB_COLOR_STEP ? align : SLAB_COLOR_STEP,
+        .constructor = constructor,
+    };
+    cache->objects_per_slab = (PAGE_SIZE - cache->first_offset) / size;
+    cache->color_range = PAGE_SIZE - cache->first_offset - cache->objects_per_slab * size;
+
+    debug_log_fmt(
+        "[*] Created the %s cache (%d bytes, %d objects per slab)\n",
+        name,
+        size,
+        cache->objects_per_slab);
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    slab_t *slab = cache->partial.head;
+    if (slab == NULL) {
+        slab = cache->empty.head;
+        if (slab != NULL)
+            _slab_unlink(&cache->empty, slab);
+        else
+            slab = _slab_create(cache);
+        if (slab == NULL) {
+            debug_log_fmt("[-] kmem_cache_alloc: Could not grow the %s cache\n", cache->name);
+            return NULL;
+        }
+    } else {
+        _slab_unlink(&cache->partial, slab);
+    }
+
+    void **object = slab->free_list;
+    slab->free_list = *object;
+    slab->in_use++;
+    _slab_link(_slab_list(cache, slab), slab);
+
+    cache->active_objects++;
+    cache->allocations++;
+    if (cache->constructor != NULL)
+        cache->constructor(object);
+    return object;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+    if (object == NULL)
+        return;
+
+    slab_t *slab = (slab_t *) PAGE_DOWN((uintptr_t) object);
+    if (slab->cache != cache) {
+        debug_log_fmt(
+            "[!] kmem_cache_free: 0x%x does not belong to the %s cache\n", object, cache->name);
+        return;
+    }
+
+    _slab_unlink(_slab_list(cache, slab), slab);
+    *(void **) object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->active_objects--;
+    cache->frees++;
+
+    if (slab->in_use == 0 && cache->empty.count >= SLAB_MAX_EMPTY)
+        _slab_destroy(slab);
+    else
+        _slab_link(_slab_list(cache, slab), slab);
+}
+
+void kmem_cache_shrink(kmem_cache_t *cache)
+{
+    while (cache->empty.head != NULL) {
+        slab_t *slab = cache->empty.head;
+        _slab_unlink(&cache->empty, slab);
+        _slab_destroy(slab);
+    }
+}
+
+size_t kmem_cache_get_stats(kmem_cache_stats_t *stats, size_t max)
+{
+    size_t count = _cache_count < max ? _cache_count : max;
+    for (size_t i = 0; i < count; i++) {
+        kmem_cache_t *cache = &_caches[i];
+        size_t slabs = cache->partial.count + cache->full.count + cache->empty.count;
+        stats[i] = (kmem_cache_stats_t) {
+            .name = cache->name,
+            .object_size = cache->object_size,
+            .objects_per_slab = cache->objects_per_slab,
+            .active_objects = cache->active_objects,
+            .total_objects = slabs * cache->objects_per_slab,
+            .partial_slabs = cache->partial.count,
+            .full_slabs = cache->full.count,
+            .empty_slabs = cache->empty.count,
+            .allocations = cache->allocations,
+            .frees = cache->frees,
+        };
+    }
+    return count;
+}
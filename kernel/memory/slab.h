@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Maximum number of object caches.
+ */
+#define SLAB_MAX_CACHES 32
+
+/*
+ * Largest object a cache can hold. Slabs are single pages, so that the slab of an
+ * object is found by rounding its address down.
+ */
+#define SLAB_MAX_OBJECT_SIZE 512
+
+/*
+ * Number of empty slabs a cache keeps around before giving pages back to the PMM.
+ */
+#define SLAB_MAX_EMPTY 2
+
+typedef struct kmem_cache kmem_cache_t;
+
+/*
+ * Statistics of an object cache.
+ */
+typedef struct
+{
+    const char *name;
+    size_t object_size;      /* Size of one object, padding included */
+    size_t objects_per_slab;
+    size_t active_objects;   /* Objects currently handed out */
+    size_t total_objects;    /* Objects held by all the slabs of the cache */
+    size_t partial_slabs;
+    size_t full_slabs;
+    size_t empty_slabs;
+    size_t allocations;      /* Calls to kmem_cache_alloc that returned an object */
+    size_t frees;
+} kmem_cache_stats_t;
+
+/*
+ * Create a cache of fixed-size objects aligned to align bytes (0 for the default
+ * alignment). The optional constructor is run on every object handed out by
+ * kmem_cache_alloc.
+ * Returns the new cache, or NULL if the object is too big or there are too many caches.
+ */
+kmem_cache_t *kmem_cache_create(
+    const char *name,
+    size_t size,
+    size_t align,
+    void (*constructor)(void *));
+
+/*
+ * Allocate an object from a cache.
+ * Returns a pointer to the object, or NULL if no memory is left.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/*
+ * Give an object back to the cache it was allocated from.
+ * Does nothing if the object is NULL.
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+
+/*
+ * Give the pages of every empty slab of a cache back to the PMM.
+ */
+void kmem_cache_shrink(kmem_cache_t *cache);
+
+/*
+ * Stores the statistics of up to max caches.
+ * Returns the number of caches described.
+ */
+size_t kmem_cache_get_stats(kmem_cache_stats_t *stats, size_t max);
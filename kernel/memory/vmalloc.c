@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/arch/pc/idt.h>
+#include <kernel/debug.h>
+#include <kernel/init.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/slab.h>
+#include <kernel/memory/vmalloc.h>
+#include <kernel/memory/vmm.h>
+
+/*
+ * A range of the vmalloc space handed out by vmalloc.
+ */
+typedef struct vmalloc_area
+{
+    struct vmalloc_area *next;
+    uintptr_t base;
+    size_t pages; /* Mapped pages, the guard page after them is not counted */
+    uint16_t tag;
+} vmalloc_area_t;
+
+/* Allocated areas, sorted by address */
+static vmalloc_area_t *_areas;
+static kmem_cache_t *_area_cache;
+static size_t _area_count = 0;
+static size_t _mapped_pages = 0;
+
+/* Areas freed in IRQ handlers, linked through their first word, waiting to be unmapped */
+static void *_deferred_frees;
+static size_t _deferred_count = 0;
+
+/*
+ * Returns the area starting at an address and stores the area before it, or returns
+ * NULL if no area starts there.
+ */
+static vmalloc_area_t *_find_area(uintptr_t base, vmalloc_area_t **previous)
+{
+    vmalloc_area_t *prev = NULL;
+    for (vmalloc_area_t *area = _areas; area != NULL && area->base <= base; area = area->next) {
+        if (area->base == base) {
+            if (previous != NULL)
+                *previous = prev;
+            return area;
+        }
+        prev = area;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the end of the free virtual range that follows an area.
+ */
+static uintptr_t _room_after(vmalloc_area_t *area)
+{
+    return area->next != NULL ? area->next->base : VMALLOC_END;
+}
+
+static void _unmap_pages(uintptr_t base, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; i++) {
+        uintptr_t virt = base + i * PAGE_SIZE;
+        void *phys = (void *) vmm_get_phys(virt);
+        vmm_unmap(virt, true);
+        pmm_free(phys, 1);
+    }
+    _mapped_pages -= last - first;
+}
+
+/*
+ * Backs pages [first, last) of an area with frames from the PMM.
+ * Returns false, with none of the pages mapped, if the PMM runs out of memory.
+ */
+static bool _map_pages(uintptr_t base, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; i++) {
+        void *phys = pmm_alloc(1);
+        if (phys == NULL) {
+            _mapped_pages += i - first;
+            _unmap_pages(base, first, i);
+            return false;
+        }
+        vmm_map(base + i * PAGE_SIZE, (uintptr_t) phys, PTFLAG_P | PTFLAG_RW, false);
+    }
+    _mapped_pages += last - first;
+    return true;
+}
+
+static void _vfree(void *pointer)
+{
+    vmalloc_area_t *previous = NULL;
+    vmalloc_area_t *area = _find_area((uintptr_t) pointer, &previous);
+    if (area == NULL) {
+        debug_log_fmt("[!] vfree: 0x%x was not returned by vmalloc\n", pointer);
+        return;
+    }
+
+    _unmap_pages(area->base, 0, area->pages);
+    if (previous != NULL)
+        previous->next = area->next;
+    else
+        _areas = area->next;
+    _area_count--;
+    kmem_cache_free(_area_cache, area);
+}
+
+/*
+ * Frees the areas given to vfree by IRQ handlers.
+ * Must not be called from an IRQ handler.
+ */
+static void _drain_deferred()
+{
+    if (__atomic_load_n(&_deferred_frees, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    void *pointer = __atomic_exchange_n(&_deferred_frees, NULL, __ATOMIC_ACQUIRE);
+    while (pointer != NULL) {
+        void *next = *(void **) pointer;
+        __atomic_fetch_sub(&_deferred_count, 1, __ATOMIC_RELAXED);
+        _vfree(pointer);
+        pointer = next;
+    }
+}
+
+void __init vmalloc_init()
+{
+    _area_cache = kmem_cache_create("vmalloc_area", sizeof(vmalloc_area_t), 0, NULL);
+    debug_log_fmt("[*] vmalloc range: 0x%x - 0x%x\n", VMALLOC_START, VMALLOC_END);
+}
+
+void *vmalloc(size_t size)
+{
+    size_t pages = PAGE_UP(size) / PAGE_SIZE;
+    if (pages == 0 || pages >= (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+        return NULL;
+    _drain_deferred();
+
+    /* First fit, keeping one unmapped page after every area */
+    uintptr_t base = VMALLOC_START;
+    vmalloc_area_t *previous = NULL;
+    for (vmalloc_area_t *area = _areas; area != NULL; area = area->next) {
+        if (area->base - base >= (pages + 1) * PAGE_SIZE)
+            break;
+        base = area->base + (area->pages + 1) * PAGE_SIZE;
+        previous = area;
+    }
+    if (VMALLOC_END - base < (pages + 1) * PAGE_SIZE) {
+        debug_log_fmt("[-] vmalloc failed: No room left for %d pages\n", pages);
+        return NULL;
+    }
+
+    vmalloc_area_t *area = kmem_cache_alloc(_area_cache);
+    if (area == NULL)
+        return NULL;
+    if (!_map_pages(base, 0, pages)) {
+        debug_log_fmt("[-] vmalloc failed: Could not back %d pages\n", pages);
+        kmem_cache_free(_area_cache, area);
+        return NULL;
+    }
+
+    area->base = base;
+    area->pages = pages;
+    area->tag = 0;
+    area->next = previous != NULL ? previous->next : _areas;
+    if (previous != NULL)
+        previous->next = area;
+    else
+        _areas = area;
+    _area_count++;
+    return (void *) base;
+}
+
+bool vmalloc_resize(void *pointer, size_t size)
+{
+    _drain_deferred();
+    vmalloc_area_t *area = _find_area((uintptr_t) pointer, NULL);
+    if (area == NULL) {
+        debug_log_fmt("[!] vmalloc_resize: 0x%x was not returned by vmalloc\n", pointer);
+        return false;
+    }
+
+    size_t pages = PAGE_UP(size) / PAGE_SIZE;
+    if (pages == 0)
+        pages = 1;
+
+    if (pages < area->pages) {
+        _unmap_pages(area->base, pages, area->pages);
+    } else if (pages > area->pages) {
+        /* The guard page moves to the end of the grown area */
+        if ((_room_after(area) - area->base) / PAGE_SIZE < pages + 1)
+            return false;
+        if (!_map_pages(area->base, area->pages, pages))
+            return false;
+    }
+    area->pages = pages;
+    return true;
+}
+
+void vfree(void *pointer)
+{
+    if (pointer == NULL)
+        return;
+    if (PAGE_DOWN((uintptr_t) pointer) != (uintptr_t) pointer) {
+        debug_log_fmt("[!] vfree: 0x%x was not returned by vmalloc\n", pointer);
+        return;
+    }
+
+    /*
+     * The area list, the slab caches and the PMM are not safe to touch from an IRQ
+     * handler, which may have interrupted them. The area is freed later instead.
+     */
+    if (__builtin_expect(in_irq(), false)) {
+        void *head = __atomic_load_n(&_deferred_frees, __ATOMIC_RELAXED);
+        do {
+            *(void **) pointer = head;
+        } while (!__atomic_compare_exchange_n(
+            &_deferred_frees, &head, pointer, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        __atomic_fetch_add(&_deferred_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    _drain_deferred();
+    _vfree(pointer);
+}
+
+void vmalloc_idle()
+{
+    _drain_deferred();
+}
+
+size_t vmalloc_size(void *pointer)
+{
+    vmalloc_area_t *area = _find_area((uintptr_t) pointer, NULL);
+    return area != NULL ? area->pages * PAGE_SIZE : 0;
+}
+
+void vmalloc_set_tag(void *pointer, uint16_t tag)
+{
+    vmalloc_area_t *area = _find_area((uintptr_t) pointer, NULL);
+    if (area != NULL)
+        area->tag = tag;
+}
+
+uint16_t vmalloc_get_tag(void *pointer)
+{
+    vmalloc_area_t *area = _find_area((uintptr_t) pointer, NULL);
+    return area != NULL ? area->tag : 0;
+}
+
+vmalloc_stats_t vmalloc_get_stats()
+{
+    return (vmalloc_stats_t) {
+        .areas = _area_count,
+        .mapped_pages = _mapped_pages,
+        .deferred_frees = __atomic_load_n(&_deferred_count, __ATOMIC_RELAXED),
+    };
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kernel virtual range backing vmalloc allocations. It takes one whole top level
+ * page table entry (512 GiB) between the direct map and the kernel image.
+ */
+#define VMALLOC_START 0xFFFFC90000000000ULL
+#define VMALLOC_END (VMALLOC_START + (512ULL << 30))
+
+/*
+ * Requests of at least this many bytes made through kmalloc are served by vmalloc,
+ * so that they do not need physically contiguous pages.
+ */
+#define VMALLOC_THRESHOLD (32 * 1024)
+
+/*
+ * vmalloc statistics and information.
+ */
+typedef struct
+{
+    size_t areas;          /* Live allocations */
+    size_t mapped_pages;   /* Pages backing the live allocations */
+    size_t deferred_frees; /* Areas freed in IRQ handlers and not unmapped yet */
+} vmalloc_stats_t;
+
+/*
+ * Initialize the vmalloc allocator.
+ */
+void vmalloc_init();
+
+/*
+ * Allocate page-aligned, virtually contiguous kernel memory backed by pages taken one
+ * at a time from the PMM. Every allocation is followed by an unmapped guard page.
+ * Returns a pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void *vmalloc(size_t size);
+
+/*
+ * Grow or shrink a vmalloc allocation without moving it.
+ * Returns false if the allocation cannot grow because the range after it is taken.
+ */
+bool vmalloc_resize(void *pointer, size_t size);
+
+/*
+ * Free memory returned by vmalloc. Does nothing if the pointer is NULL.
+ * In IRQ handlers, the area is only queued and is freed by the next vmalloc call,
+ * vfree call outside of IRQ handlers or vmalloc_idle.
+ */
+void vfree(void *pointer);
+
+/*
+ * Free the areas queued by vfree in IRQ handlers.
+ * Meant to be called from idle loops.
+ */
+void vmalloc_idle();
+
+/*
+ * Returns the usable size of a vmalloc allocation, in bytes.
+ */
+size_t vmalloc_size(void *pointer);
+
+/*
+ * Attach a tag to a vmalloc allocation, for use by the allocation profiler. Tags
+ * start at 0.
+ */
+void vmalloc_set_tag(void *pointer, uint16_t tag);
+
+/*
+ * Returns the tag of a vmalloc allocation, or 0 if the pointer is not one.
+ */
+uint16_t vmalloc_get_tag(void *pointer);
+
+/*
+ * Returns true if a pointer lies in the vmalloc range.
+ */
+static inline bool is_vmalloc_addr(const void *pointer)
+{
+    return (uintptr_t) pointer >= VMALLOC_START && (uintptr_t) pointer < VMALLOC_END;
+}
+
+/*
+ * Returns information about the vmalloc allocations.
+ */
+vmalloc_stats_t vmalloc_get_stats();
@@ -29,21 +29,80 @@ typedef enum : uint64_t {
     PTFLAG_P = 1 << 0,   /* Present */
 } pt_flags_t;
 
+/*
+ * Copy the bootloader information needed by the memory managers.
+ * Must be called before any other memory management function.
+ */
+void vmm_early_init();
+
 /*
  * Initialize the virtual memory manager.
  */
 void vmm_init(struct limine_memmap_response *);
 
+/*
+ * Create an address space with an empty user half. Its kernel half is shared with
+ * every other address space.
+ * Returns the physical address of its top level table, or 0 if no memory is left.
+ */
+uintptr_t vmm_create_address_space();
+
+/*
+ * Free the page tables of the user half of an address space, but not the pages they
+ * map. Switches to the kernel address space if the address space is the current one.
+ */
+void vmm_destroy_address_space(uintptr_t space);
+
+/*
+ * Load an address space. Does nothing if it is already loaded. With PCIDs, the TLB
+ * keeps the entries of the address spaces loaded recently.
+ */
+void vmm_switch_address_space(uintptr_t space);
+
+/*
+ * Returns the address space built at boot, which only holds kernel mappings.
+ */
+uintptr_t vmm_get_kernel_address_space();
+
+/*
+ * Returns the address space currently loaded.
+ */
+uintptr_t vmm_get_current_address_space();
+
 /*
  * Map a single page from a physical to a virtual address.
  */
 void vmm_map(uintptr_t virt_addr, uintptr_t phys_addr, size_t flags, bool flush);
 
 /*
- * Map a specified number of pages from a physical to a virtual address.
+ * Map a specified number of pages from a physical to a virtual address in the current
+ * address space.
  */
 void vmm_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t size, size_t flags, bool flush);
 
+/*
+ * Map a specified number of pages in an address space that may not be the current one.
+ */
+void vmm_map_range_in(
+    uintptr_t space,
+    uintptr_t virt_addr,
+    uintptr_t phys_addr,
+    size_t size,
+    size_t flags,
+    bool flush);
+
+/*
+ * Returns the physical address a virtual address is mapped to, or 0 if it is not
+ * mapped.
+ */
+uintptr_t vmm_get_phys(uintptr_t virt_addr);
+
+/*
+ * Returns the physical address a virtual address is mapped to in an address space,
+ * or 0 if it is not mapped.
+ */
+uintptr_t vmm_get_phys_in(uintptr_t space, uintptr_t virt_addr);
+
 /*
  * Unmap a single page from a virtual address.
  */
@@ -54,6 +113,18 @@ void vmm_unmap(uintptr_t virt_addr, bool flush);
  */
 void vmm_unmap_range(uintptr_t virt_addr, size_t size, bool flush);
 
+/*
+ * Unmap a specified number of pages from an address space that may not be the
+ * current one.
+ */
+void vmm_unmap_range_in(uintptr_t space, uintptr_t virt_addr, size_t size, bool flush);
+
+/*
+ * Unmap the init sections of the kernel image and give their memory to the PMM.
+ * Must be called once, after the last function placed in the init sections.
+ */
+void vmm_free_init_sections();
+
 /*
  * Convert a physical address to a high-half direct mapped address.
  */
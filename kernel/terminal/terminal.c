@@ -7,6 +7,8 @@
 #include <kernel/input/ps2_keyboard.h>
 #include <kernel/memory/heap.h>
 #include <kernel/memory/memstat.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/vmalloc.h>
 #include <kernel/terminal/kshell.h>
 #include <kernel/terminal/terminal.h>
 #include <libs/flanterm/src/flanterm_backends/fb.h>
@@ -172,8 +174,12 @@ char kgetc()
 {
     kflush();
     _waiting_for_key = true;
-    while (_waiting_for_key)
+    while (_waiting_for_key) {
+        /* Use the idle time to prepare zeroed pages and free what IRQ handlers released */
+        pmm_idle();
+        vmalloc_idle();
         __asm__("hlt");
+    }
 
     const keyboard_layout_t *layout = &keyboard_layouts[KB_LAYOUT_US];
     uint8_t scancode = (uint8_t) _last_event.scancode;
@@ -205,12 +211,11 @@ void kflush()
     }
 }
 
-void term_init(struct limine_framebuffer_response *response)
+void term_init(struct limine_framebuffer *fb)
 {
     if (_fb_ctx != NULL)
         flanterm_deinit(_fb_ctx, NULL);
 
-    struct limine_framebuffer *fb = response->framebuffers[0];
     _fb_ctx = flanterm_fb_init(
         (void *) kmalloc,
         (void *) kfree,
@@ -44,6 +44,6 @@ void kprintf(const char *, ...);
 void kflush();
 
 /*
- * Initializes the terminal.
+ * Initializes the terminal on the given framebuffer.
  */
-void term_init(struct limine_framebuffer_response *response);
+void term_init(struct limine_framebuffer *fb);
@@ -9,3 +9,8 @@
 
 void timer_init();
 void sleep(uint64_t ms);
+
+/*
+ * Returns the number of milliseconds elapsed since the timer was started.
+ */
+uint64_t timer_get_ticks();
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include <kernel/debug.h>
+#include <kernel/init.h>
+#include <kernel/klibc/memory.h>
+#include <kernel/memory/pmm.h>
+#include <kernel/memory/vmm.h>
+#include <kernel/usermode/fault.h>
+#include <kernel/usermode/task.h>
+
+/*
+ * Page fault error code bits.
+ * Check Intel's x86 Developer Manual Volume 3A, Section 5.7, Figure 5-12.
+ */
+#define PF_PRESENT (1 << 0)     /* The page was present, the access broke its protection */
+#define PF_WRITE (1 << 1)       /* The access was a write */
+#define PF_INSTRUCTION (1 << 4) /* The access was an instruction fetch */
+
+#define USER_SPACE_END 0x0000800000000000ULL
+
+/* Mapped read-only wherever a task reads anonymous memory it never wrote */
+static uintptr_t _zero_page;
+static page_fault_stats_t _stats;
+
+void __init page_fault_init()
+{
+    /* The allocation reference is never dropped, the zero page lives forever */
+    _zero_page = (uintptr_t) pmm_alloc_zeroed(1);
+    if (_zero_page == 0)
+        debug_log("[-] Failed to allocate the zero page\n");
+}
+
+static inline uintptr_t _max(uintptr_t a, uintptr_t b)
+{
+    return a > b ? a : b;
+}
+
+static inline uintptr_t _min(uintptr_t a, uintptr_t b)
+{
+    return a < b ? a : b;
+}
+
+/*
+ * Returns true if a file region of a task has data in [start, end).
+ */
+static bool _has_file_data(task_t *task, uintptr_t start, uintptr_t end)
+{
+    for (size_t i = 0; i < task->memory.regions_count; i++) {
+        task_region_t *region = &task->memory.regions[i];
+        if (region->type == TASK_REGION_FILE
+            && _max(start, region->data_start) < _min(end, region->data_start + region->data_size))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Fills the pages of a task starting at virt, held at buffer in the direct map, with
+ * the data of every file region overlapping them and zeroes elsewhere. Segments of an
+ * ELF file may share a page.
+ * Returns false if a file could not be read.
+ */
+static bool _fill_pages(task_t *task, uintptr_t virt, void *buffer, size_t pages)
+{
+    uintptr_t end = virt + pages * PAGE_SIZE;
+    memset(buffer, 0, pages * PAGE_SIZE);
+    for (size_t i = 0; i < task->memory.regions_count; i++) {
+        task_region_t *region = &task->memory.regions[i];
+        if (region->type != TASK_REGION_FILE)
+            continue;
+
+        uintptr_t low = _max(virt, region->data_start);
+        uintptr_t high = _min(end, region->data_start + region->data_size);
+        if (low >= high)
+            continue;
+        size_t offset = region->file_offset + (low - region->data_start);
+        if (file_seek(&region->file, offset, SEEK_SET) < 0
+            || file_read(&region->file, buffer + (low - virt), high - low) < 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Maps a page of its own, zero filled, at virt.
+ */
+static bool _map_anonymous(task_t *task, task_region_t *region, uintptr_t virt)
+{
+    /* Stack and bss pages follow the color cursor of the task like its other pages */
+    void *page = pmm_alloc_colored_zeroed(1, &task->color);
+    if (page == NULL)
+        return false;
+
+    /* The mapping takes over the allocation reference, replacing the zero page if any */
+    bool mapped = task_map(task, virt, (uintptr_t) page, 1, region->flags) == 0;
+    pmm_free(page, 1);
+    _stats.anonymous_faults += mapped;
+    return mapped;
+}
+
+/*
+ * Reads the page at virt from its file, with the unmapped pages next to it in the
+ * aligned window of FAULT_AROUND_PAGES pages, so that sequential accesses take one
+ * fault per window instead of one per page.
+ * Returns the number of pages mapped, 0 if none could be.
+ */
+static size_t _map_file(task_t *task, task_region_t *region, uintptr_t virt)
+{
+    uintptr_t window = virt & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    uintptr_t low = _max(region->start, window);
+    uintptr_t high = _min(region->end, window + FAULT_AROUND_PAGES * PAGE_SIZE);
+
+    uintptr_t first = virt;
+    uintptr_t last = virt + PAGE_SIZE;
+    while (first > low && vmm_get_phys_in(task->state.cr3, first - PAGE_SIZE) == 0)
+        first -= PAGE_SIZE;
+    while (last < high && vmm_get_phys_in(task->state.cr3, last) == 0)
+        last += PAGE_SIZE;
+
+    size_t pages = (last - first) / PAGE_SIZE;
+    void *phys = pmm_alloc_colored(pages, &task->color);
+    if (phys == NULL && pages > 1) {
+        first = virt;
+        pages = 1;
+        phys = pmm_alloc_colored(1, &task->color);
+    }
+    if (phys == NULL)
+        return 0;
+
+    if (!_fill_pages(task, first, vmm_get_hhdm_addr(phys), pages)) {
+        debug_log_fmt("[-] Failed to read the page at 0x%x from its file\n", virt);
+        pmm_free(phys, pages);
+        return 0;
+    }
+    bool mapped = task_map(task, first, (uintptr_t) phys, pages, region->flags) == 0;
+    pmm_free(phys, pages);
+    return mapped ? pages : 0;
+}
+
+/*
+ * Gives the task a page of its own at virt in place of the page it shares with other
+ * tasks since a fork. When the other tasks have let go of the page, the task keeps it
+ * and only gets its write access back.
+ */
+static bool _copy_on_write(task_t *task, task_region_t *region, uintptr_t virt, uintptr_t phys)
+{
+    page_t *page = page_lookup(phys);
+    if (page != NULL && page->refcount == 1) {
+        bool mapped = task_map(task, virt, phys, 1, region->flags) == 0;
+        _stats.cow_reuses += mapped;
+        return mapped;
+    }
+
+    void *copy = pmm_alloc_colored(1, &task->color);
+    if (copy == NULL)
+        return false;
+    memcpy(vmm_get_hhdm_addr(copy), vmm_get_hhdm_addr((void *) phys), PAGE_SIZE);
+
+    /* Mapping the copy drops the reference of the task on the shared page */
+    bool mapped = task_map(task, virt, (uintptr_t) copy, 1, region->flags) == 0;
+    pmm_free(copy, 1);
+    _stats.cow_copies += mapped;
+    return mapped;
+}
+
+bool page_fault_handle(uintptr_t address, uint64_t error_code)
+{
+    task_t *task = task_get_current();
+    if (task == NULL || !task->user_mode || address >= USER_SPACE_END)
+        return false;
+    task_region_t *region = task_find_region(task, address);
+    if (region == NULL)
+        return false;
+
+    uintptr_t virt = PAGE_DOWN(address);
+    bool write = error_code & PF_WRITE;
+    if (error_code & PF_PRESENT) {
+        /*
+         * Only writes to read-only pages of writable regions are expected: the zero page
+         * or pages shared since a fork. Anything else is a bug of the task.
+         */
+        if (!write || !(region->flags & PTFLAG_RW))
+            return false;
+        uintptr_t phys = vmm_get_phys_in(task->state.cr3, virt);
+        if (phys == _zero_page)
+            return _map_anonymous(task, region, virt);
+        return _copy_on_write(task, region, virt, phys);
+    }
+
+    if (_has_file_data(task, virt, virt + PAGE_SIZE)) {
+        size_t pages = _map_file(task, region, virt);
+        if (pages != 0) {
+            _stats.file_faults++;
+            _stats.fault_around_pages += pages - 1;
+        }
+        return pages != 0;
+    }
+
+    /* Memory that is read before being written reads as zeroes, one page serves them all */
+    if (!write && !(error_code & PF_INSTRUCTION) && _zero_page != 0) {
+        vmm_map_range_in(
+            task->state.cr3, virt, _zero_page, PAGE_SIZE, region->flags & ~PTFLAG_RW, false);
+        _stats.zero_page_faults++;
+        return true;
+    }
+    return _map_anonymous(task, region, virt);
+}
+
+bool page_fault_populate(task_t *task)
+{
+    for (size_t i = 0; i < task->memory.regions_count; i++) {
+        task_region_t *region = &task->memory.regions[i];
+        if (region->type != TASK_REGION_FILE)
+            continue;
+        for (uintptr_t virt = region->start; virt < region->end; virt += PAGE_SIZE) {
+            if (vmm_get_phys_in(task->state.cr3, virt) == 0 && _map_file(task, region, virt) == 0)
+                return false;
+        }
+    }
+
+    /* Regions sharing a page were all read before any of them lets go of its file */
+    for (size_t i = 0; i < task->memory.regions_count; i++) {
+        task_region_t *region = &task->memory.regions[i];
+        if (region->type == TASK_REGION_FILE) {
+            *region = (task_region_t) {
+                .type = TASK_REGION_ANONYMOUS,
+                .start = region->start,
+                .end = region->end,
+                .flags = region->flags,
+            };
+        }
+    }
+    return true;
+}
+
+page_fault_stats_t page_fault_get_stats()
+{
+    return _stats;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025, Ibrahim KAIKAA <ibrahimkaikaa@gmail.com>
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#pragma once
+
+#include <kernel/usermode/task.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Number of pages of the aligned window around a file-backed fault that are mapped
+ * along with the faulting page.
+ */
+#define FAULT_AROUND_PAGES 16
+
+/*
+ * Page fault statistics.
+ */
+typedef struct
+{
+    size_t anonymous_faults;   /* Faults that mapped a zero-filled page of its own */
+    size_t zero_page_faults;   /* Read faults that mapped the shared zero page */
+    size_t file_faults;        /* Faults that read pages from a file */
+    size_t fault_around_pages; /* Pages mapped next to a file-backed faulting page */
+    size_t cow_copies;         /* Writes to a page shared since a fork that copied it */
+    size_t cow_reuses;         /* Writes to a page no other task shared any more */
+} page_fault_stats_t;
+
+/*
+ * Set up the shared zero page.
+ */
+void page_fault_init();
+
+/*
+ * Map the page of the current task holding a faulting address, given the error code
+ * pushed by the CPU.
+ * Returns true if the access can be retried, false if it is a real fault.
+ */
+bool page_fault_handle(uintptr_t address, uint64_t error_code);
+
+/*
+ * Map every page of the file regions of a task and turn them into anonymous regions,
+ * for files that may change or go away while the task runs.
+ * Returns false if no memory is left or a file could not be read.
+ */
+bool page_fault_populate(task_t *task);
+
+/*
+ * Returns the page fault statistics.
+ */
+page_fault_stats_t page_fault_get_stats();
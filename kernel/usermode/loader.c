@@ -3,18 +3,23 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
-#include <kernel/arch/pc/asm.h>
 #include <kernel/debug.h>
 #include <kernel/fs/vfs.h>
-#include <kernel/klibc/memory.h>
 #include <kernel/memory/heap.h>
 #include <kernel/memory/pmm.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/usermode/elf.h>
+#include <kernel/usermode/fault.h>
 #include <kernel/usermode/loader.h>
 #include <kernel/usermode/task.h>
 #include <stdint.h>
 
+/*
+ * The user stack grows down from USER_STACK_TOP and may use up to USER_STACK_PAGES pages.
+ */
+#define USER_STACK_TOP 0x00007fffe000a000ULL
+#define USER_STACK_PAGES 256
+
 int load_elf(file_t *file)
 {
     debug_log("[*] Loading ELF file...\n");
@@ -39,71 +44,81 @@ int load_elf(file_t *file)
 
     elf64_psh_t psh;
     task_t *task = task_create((void *) header.entry_offset, TASK_MODE_USER);
+    if (!task) {
+        debug_log("[-] Failed to create the task\n");
+        return -1;
+    }
 
+    /* Segments are read from the file as the task touches them */
     for (int i = 0; i < header.pht_entry_count; i++) {
         if (file_seek(file, header.pht_offset + i * header.pht_entry_size, SEEK_SET) < 0)
-            return -1;
+            goto failure;
 
         if (parse_elf_program_header(file, &psh, header.pht_entry_size) < 0)
-            return -1;
-
-        uintptr_t vaddr = psh.section_vaddr;
-        uintptr_t vaddr_end = vaddr + psh.section_memory_size;
-        uintptr_t vaddr_start = vaddr & ~(PAGE_SIZE - 1);
-        uintptr_t vaddr_end_aligned = PAGE_UP(vaddr_end);
-        size_t npages = (vaddr_end_aligned - vaddr_start) / PAGE_SIZE;
-
-        void *phys_mem = pmm_alloc(npages);
-        if (!phys_mem) {
-            debug_log("[-] Failed to allocate physical memory for segment\n");
-            return -1;
-        }
-
-        uint64_t flags = PTFLAG_US | PTFLAG_P | PTFLAG_RW | PTFLAG_XD;
-        task_map(task, vaddr_start, (uintptr_t) phys_mem, npages, flags, true);
-
-        void *hddm_addr = vmm_get_hhdm_addr(phys_mem);
-        memset(hddm_addr, 0, npages * PAGE_SIZE);
-
-        size_t offset_in_page = vaddr - vaddr_start;
-        if (file_seek(file, psh.section_offset, SEEK_SET) < 0) {
-            debug_log("[-] Failed to seek to segment offset\n");
-            pmm_free(phys_mem, npages);
-            return -1;
+            goto failure;
+        if (psh.type != SECTION_TYPE_LOAD || psh.section_memory_size == 0)
+            continue;
+
+        task_region_t region = {
+            .type = TASK_REGION_FILE,
+            .start = PAGE_DOWN(psh.section_vaddr),
+            .end = PAGE_UP(psh.section_vaddr + psh.section_memory_size),
+            .flags = PTFLAG_US | PTFLAG_P | PTFLAG_RW | PTFLAG_XD,
+            .file = *file,
+            .data_start = psh.section_vaddr,
+            .data_size = psh.section_file_size,
+            .file_offset = psh.section_offset,
+        };
+        if (task_add_region(task, &region) < 0) {
+            debug_log("[-] Failed to add a segment to the task\n");
+            goto failure;
         }
+    }
 
-        if (file_read(file, hddm_addr + offset_in_page, psh.section_file_size) < 0) {
-            debug_log("[-] Failed to read segment data\n");
-            pmm_free(phys_mem, npages);
-            return -1;
-        }
+    /* Files that may be written or removed under the task are read in full right away */
+    if (!file->drive->read_only && !page_fault_populate(task)) {
+        debug_log("[-] Failed to read the segments of the task\n");
+        goto failure;
     }
 
-    void *stack = pmm_alloc(10);
-    task_map(
-        task,
-        0x00007fffe0000000ULL,
-        (uintptr_t) stack,
-        10,
-        PTFLAG_US | PTFLAG_RW | PTFLAG_P,
-        true);
+    /* Stack pages are only allocated as the stack grows into them */
+    task_region_t stack = {
+        .type = TASK_REGION_ANONYMOUS,
+        .start = USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE,
+        .end = USER_STACK_TOP,
+        .flags = PTFLAG_US | PTFLAG_RW | PTFLAG_P,
+    };
+    if (task_add_region(task, &stack) < 0) {
+        debug_log("[-] Failed to add the user stack to the task\n");
+        goto failure;
+    }
 
-    void *kernelstack = pmm_alloc(10);
-    task_map(
-        task,
-        -(10LL * PAGE_SIZE),
-        (uintptr_t) kernelstack,
-        10,
-        PTFLAG_RW | PTFLAG_P,
-        false);
+    /*
+     * Every task maps its kernel stack at the same address, so the kernel may still be
+     * running on it when the task is destroyed. Keep the allocation reference.
+     */
+    void *kernelstack = pmm_alloc_colored(10, &task->color);
+    if (kernelstack == NULL) {
+        /* Loading runs from the shell, out of any lock, where compaction is allowed */
+        kernelstack = pmm_alloc_flags(10, PMM_ALLOC_COMPACT);
+    }
+    if (kernelstack == NULL
+        || task_map(task, -(10LL * PAGE_SIZE), (uintptr_t) kernelstack, 10, PTFLAG_RW | PTFLAG_P)
+               < 0) {
+        debug_log("[-] Failed to map the kernel stack of the task\n");
+        pmm_free(kernelstack, 10);
+        goto failure;
+    }
 
-    asm_write_cr3(asm_read_cr3());
-    uintptr_t stack_top = 0x00007fffe0000000ULL + 10 * PAGE_SIZE;
-    task->state.cr3 = asm_read_cr3();
-    task->state.rsp = stack_top;
+    task->state.rsp = USER_STACK_TOP;
     task->state.rsp0 = 0xFFFFFFFFFFFFF000LL;
     task_switch(task);
 
     /* Should not reach here: control transferred to the user task */
     return 0;
+
+failure:
+    /* The task is linked in the task list from its creation */
+    task_remove(task);
+    return -1;
 }
@@ -7,11 +7,12 @@
 #include <kernel/arch/pc/asm.h>
 #include <kernel/arch/pc/idt.h>
 #include <kernel/debug.h>
+#include <kernel/init.h>
 #include <kernel/fs/vfs.h>
 #include <kernel/input/ps2_keyboard.h>
 #include <kernel/input/ps2_mouse.h>
 #include <kernel/klibc/memory.h>
-#include <kernel/memory/heap.h>
+#include <kernel/memory/slab.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/terminal/kshell.h>
 #include <kernel/terminal/terminal.h>
@@ -20,8 +21,14 @@
 
 extern void _syscall_handler();
 
-void syscalls_init()
+/* Registers of the task making the current syscall, saved by _syscall_handler */
+interrupt_registers_t *_syscall_frame;
+
+static kmem_cache_t *_file_cache;
+
+void __init syscalls_init()
 {
+    _file_cache = kmem_cache_create("file", sizeof(file_t), 0, NULL);
     idt_set_gate(0x80, _syscall_handler, IDT_TYPE_SOFTWARE);
 }
 
@@ -31,15 +38,15 @@ void sys_hello()
     debug_log_fmt("[*] Syscalls are working!\n");
 }
 
-extern struct limine_framebuffer_request framebuffer_request;
+extern struct limine_framebuffer boot_framebuffer;
 int sys_request_fb(void *fb_info)
 {
-    if (framebuffer_request.response->framebuffer_count < 1)
+    if (boot_framebuffer.address == NULL)
         return -1;
-    size_t width = framebuffer_request.response->framebuffers[0]->width;
-    size_t height = framebuffer_request.response->framebuffers[0]->height;
-    void *lhfb = vmm_get_lhdm_addr(framebuffer_request.response->framebuffers[0]->address);
-    void *hhfb = framebuffer_request.response->framebuffers[0]->address;
+    size_t width = boot_framebuffer.width;
+    size_t height = boot_framebuffer.height;
+    void *lhfb = vmm_get_lhdm_addr(boot_framebuffer.address);
+    void *hhfb = boot_framebuffer.address;
     vmm_map_range(
         (uintptr_t) hhfb,
         (uintptr_t) lhfb,
@@ -66,7 +73,7 @@ int sys_register_keyboard_handler(keyboard_event_handler_t handler)
 
 void *sys_file_open(const char *path)
 {
-    file_t *file = kmalloc(sizeof(file_t));
+    file_t *file = kmem_cache_alloc(_file_cache);
     if (!file) {
         return NULL;
     }
@@ -76,7 +83,7 @@ void *sys_file_open(const char *path)
 
 void sys_file_close(void *file)
 {
-    kfree((file_t *) file);
+    kmem_cache_free(_file_cache, file);
 }
 
 int sys_file_create(const char *path, file_type_t type)
@@ -124,6 +131,23 @@ int sys_getdrives(void *buffer, uint32_t size)
     return vfs_getdrives(buffer, size);
 }
 
+/*
+ * Returns the id of the new task to the parent, 0 to the new task, or -1 on failure.
+ */
+int sys_fork()
+{
+    task_t *current = task_get_current();
+    if (!current || !current->user_mode)
+        return -1;
+
+    task_t *child = task_fork(current, _syscall_frame);
+    if (!child) {
+        debug_log("[-] Failed to fork the task\n");
+        return -1;
+    }
+    return (int) child->id;
+}
+
 int sys_exit()
 {
     task_t *current = task_get_current();
@@ -5,11 +5,13 @@
 
 #include <kernel/arch/pc/asm.h>
 #include <kernel/arch/pc/idt.h>
+#include <kernel/init.h>
 #include <kernel/input/ps2_keyboard.h>
 #include <kernel/input/ps2_mouse.h>
 #include <kernel/klibc/memory.h>
 #include <kernel/memory/heap.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/memory/slab.h>
 #include <kernel/memory/vmm.h>
 #include <kernel/usermode/task.h>
 #include <stdint.h>
@@ -24,6 +26,8 @@ static task_t _task_list_head;
 static task_t *_task_list_tail;
 static task_t *_current_task;
 static task_t *_next_task;
+static kmem_cache_t *_task_cache;
+static size_t _next_task_id = 1;
 
 extern void _task_switch_gate_stub();
 
@@ -35,19 +39,28 @@ static void _task_destroy(task_t *task);
 
 task_t *task_create(void *entry_point, task_mode_t mode)
 {
-    task_t *task = (task_t *) kmalloc(sizeof(task_t));
+    task_t *task = kmem_cache_alloc(_task_cache);
     if (!task) {
         return NULL;
     }
 
     memset(task, 0, sizeof(task_t));
+    task->id = _next_task_id++;
     task->user_mode = (mode == TASK_MODE_USER);
-    task->state.cr3 = asm_read_cr3();
+
+    /* User tasks get an address space of their own, kernel tasks share the kernel one */
+    task->state.cr3 = task->user_mode ? vmm_create_address_space()
+                                      : vmm_get_kernel_address_space();
+    if (!task->state.cr3) {
+        kmem_cache_free(_task_cache, task);
+        return NULL;
+    }
     task->state.rip = (uintptr_t) entry_point;
     task->state.rflags = DEFAULT_RFLAGS;
     task->state.cs = task->user_mode ? USER_CODE_SELECTOR : KERNEL_CODE_SELECTOR;
     task->state.ss = task->user_mode ? USER_DATA_SELECTOR : KERNEL_DATA_SELECTOR;
     task->state.rsp0 = asm_read_rsp();
+    pmm_color_init(&task->color);
 
     task->next = &_task_list_head;
     _task_list_tail->next = task;
@@ -56,45 +69,177 @@ task_t *task_create(void *entry_point, task_mode_t mode)
     return task;
 }
 
+/*
+ * Makes room for count more memory blocks in a task.
+ * Returns 0 on success, -1 if no memory is left.
+ */
+static int _task_reserve_memblocks(task_t *task, size_t count)
+{
+    size_t size = task->memory.memblocks_size ? task->memory.memblocks_size : 16;
+    while (task->memory.memblocks_count + count > size)
+        size *= 2;
+    if (size == task->memory.memblocks_size)
+        return 0;
+
+    task_memblock_t *new_memblocks = (task_memblock_t *) krealloc(
+        task->memory.memblocks, sizeof(task_memblock_t) * size);
+    if (!new_memblocks)
+        return -1;
+    task->memory.memblocks = new_memblocks;
+    task->memory.memblocks_size = size;
+    return 0;
+}
+
+/*
+ * Drops the references of a task on the pages it has mapped in [virt_addr, end).
+ * Memory blocks are cut around the range, which takes one free memory block slot when
+ * the range falls in the middle of a block.
+ */
+static void _task_release_range(task_t *task, uintptr_t virt_addr, uintptr_t end)
+{
+    for (size_t i = 0; i < task->memory.memblocks_count;) {
+        task_memblock_t *memblock = &task->memory.memblocks[i];
+        uintptr_t block_end = memblock->virt_addr + memblock->page_count * PAGE_SIZE;
+        uintptr_t low = virt_addr > memblock->virt_addr ? virt_addr : memblock->virt_addr;
+        uintptr_t high = end < block_end ? end : block_end;
+        if (low >= high) {
+            i++;
+            continue;
+        }
+
+        size_t head_pages = (low - memblock->virt_addr) / PAGE_SIZE;
+        size_t tail_pages = (block_end - high) / PAGE_SIZE;
+        uintptr_t tail_phys = memblock->phys_addr + (high - memblock->virt_addr);
+        if (memblock->phys_addr)
+            page_put(memblock->phys_addr + head_pages * PAGE_SIZE, (high - low) / PAGE_SIZE, true);
+
+        if (head_pages == 0 && tail_pages == 0) {
+            /* The last block takes the slot of the released one */
+            *memblock = task->memory.memblocks[--task->memory.memblocks_count];
+            continue;
+        }
+
+        if (head_pages != 0 && tail_pages != 0) {
+            task_memblock_t *tail = &task->memory.memblocks[task->memory.memblocks_count++];
+            *tail = *memblock;
+            tail->virt_addr = high;
+            tail->phys_addr = memblock->phys_addr ? tail_phys : 0;
+            tail->page_count = tail_pages;
+            memblock->page_count = head_pages;
+        } else if (head_pages != 0) {
+            memblock->page_count = head_pages;
+        } else {
+            memblock->virt_addr = high;
+            memblock->phys_addr = memblock->phys_addr ? tail_phys : 0;
+            memblock->page_count = tail_pages;
+        }
+        i++;
+    }
+}
+
 int task_map(
     task_t *task,
     uintptr_t virt_addr,
     uintptr_t phys_addr,
     size_t page_count,
-    uintptr_t flags,
-    bool release_on_exit)
+    uintptr_t flags)
 {
-    if (task->memory.memblocks == NULL) {
-        task->memory.memblocks_count = 0;
-        task->memory.memblocks_size = 16;
-        task->memory.memblocks = (task_memblock_t *) kmalloc(
-            sizeof(task_memblock_t) * task->memory.memblocks_size);
-        if (!task->memory.memblocks) {
-            return -1;
-        }
-    }
-
-    if (task->memory.memblocks_count == task->memory.memblocks_size) {
-        task_memblock_t *new_memblocks = (task_memblock_t *) krealloc(
-            task->memory.memblocks, sizeof(task_memblock_t) * task->memory.memblocks_size * 2);
-        if (!new_memblocks)
-            return -1;
-        task->memory.memblocks = new_memblocks;
-        task->memory.memblocks_size *= 2;
-    }
+    /* One slot for the new block, one for a block cut in two by it */
+    if (_task_reserve_memblocks(task, 2) < 0)
+        return -1;
+
+    /*
+     * The task holds a reference on its pages for as long as they are mapped. The new
+     * reference is taken first, the pages may already be mapped there.
+     */
+    page_get(phys_addr, page_count, true);
+    vmm_map_range_in(task->state.cr3, virt_addr, phys_addr, page_count * PAGE_SIZE, flags, true);
+    _task_release_range(task, virt_addr, virt_addr + page_count * PAGE_SIZE);
 
     task_memblock_t *memblock = &task->memory.memblocks[task->memory.memblocks_count++];
     memblock->virt_addr = virt_addr;
     memblock->phys_addr = phys_addr;
     memblock->page_count = page_count;
     memblock->flags = flags;
-    memblock->release_on_exit = release_on_exit;
 
-    vmm_map_range(virt_addr, phys_addr, page_count * PAGE_SIZE, flags, true);
+    return 0;
+}
+
+task_t *task_fork(task_t *parent, interrupt_registers_t *regs)
+{
+    task_t *child = task_create((void *) regs->rip, TASK_MODE_USER);
+    if (!child)
+        return NULL;
+
+    _task_state_save(child, regs);
+    child->state.rax = 0;
+    child->state.rsp0 = parent->state.rsp0;
+
+    for (size_t i = 0; i < parent->memory.regions_count; i++) {
+        if (task_add_region(child, &parent->memory.regions[i]) < 0)
+            goto failure;
+    }
+
+    /*
+     * Both tasks map the same pages, read-only. A write to one of them faults and the
+     * page fault handler gives the writer a copy, using the regions to tell these
+     * faults from real ones. The kernel stack is in the kernel half, which both tasks
+     * already share.
+     */
+    for (size_t i = 0; i < parent->memory.memblocks_count; i++) {
+        task_memblock_t *memblock = &parent->memory.memblocks[i];
+        if (!(memblock->flags & PTFLAG_US) || !memblock->phys_addr)
+            continue;
+
+        uintptr_t flags = memblock->flags & ~PTFLAG_RW;
+        if (task_map(child, memblock->virt_addr, memblock->phys_addr, memblock->page_count, flags)
+            < 0)
+            goto failure;
+        if (flags != memblock->flags) {
+            memblock->flags = flags;
+            vmm_map_range_in(
+                parent->state.cr3,
+                memblock->virt_addr,
+                memblock->phys_addr,
+                memblock->page_count * PAGE_SIZE,
+                flags,
+                true);
+        }
+    }
+    return child;
+
+failure:
+    /* Pages left read-only in the parent get their write access back on the next write */
+    task_remove(child);
+    return NULL;
+}
 
+int task_add_region(task_t *task, const task_region_t *region)
+{
+    if (task->memory.regions_count == task->memory.regions_size) {
+        size_t size = task->memory.regions_size ? task->memory.regions_size * 2 : 4;
+        task_region_t *new_regions = (task_region_t *) krealloc(
+            task->memory.regions, sizeof(task_region_t) * size);
+        if (!new_regions)
+            return -1;
+        task->memory.regions = new_regions;
+        task->memory.regions_size = size;
+    }
+
+    task->memory.regions[task->memory.regions_count++] = *region;
     return 0;
 }
 
+task_region_t *task_find_region(task_t *task, uintptr_t addr)
+{
+    for (size_t i = 0; i < task->memory.regions_count; i++) {
+        task_region_t *region = &task->memory.regions[i];
+        if (addr >= region->start && addr < region->end)
+            return region;
+    }
+    return NULL;
+}
+
 task_t *task_get_current()
 {
     return _current_task;
@@ -128,9 +273,9 @@ void _task_switch_gate(interrupt_registers_t *regs)
         _task_state_save(current, regs);
     }
 
-    if (current && current->exiting) {
+    bool reap = current && current->exiting;
+    if (reap) {
         _task_unlink(current);
-        _task_destroy(current);
         if (target == current || !target)
             target = task_next(NULL);
     }
@@ -142,19 +287,25 @@ void _task_switch_gate(interrupt_registers_t *regs)
     _current_task = target;
     _next_task = NULL;
 
+    /* Tasks sharing an address space switch without touching CR3 */
     if (_current_task->state.cr3)
-        asm_write_cr3(_current_task->state.cr3);
+        vmm_switch_address_space(_current_task->state.cr3);
+
+    /* The address space of the exiting task is not loaded any more */
+    if (reap)
+        _task_destroy(current);
 
     _task_state_load(_current_task, regs);
 }
 
-void task_switching_init()
+void __init task_switching_init()
 {
+    _task_cache = kmem_cache_create("task", sizeof(task_t), 0, NULL);
     memset(&_task_list_head, 0, sizeof(_task_list_head));
     _task_list_head.next = &_task_list_head;
     _task_list_head.user_mode = false;
     _task_list_head.exiting = false;
-    _task_list_head.state.cr3 = asm_read_cr3();
+    _task_list_head.state.cr3 = vmm_get_kernel_address_space();
     _task_list_head.state.cs = KERNEL_CODE_SELECTOR;
     _task_list_head.state.ss = KERNEL_DATA_SELECTOR;
     _task_list_head.state.rflags = DEFAULT_RFLAGS;
@@ -234,7 +385,6 @@ static void _task_state_save(task_t *task, interrupt_registers_t *regs)
     task->state.rip = regs->rip;
     task->state.rsp = regs->rsp;
     task->state.rflags = regs->rflags ? regs->rflags : DEFAULT_RFLAGS;
-    task->state.cr3 = asm_read_cr3();
     task->state.rsp0 = asm_read_rsp();
 
     uint16_t cs = (uint16_t) regs->cs;
@@ -312,18 +462,19 @@ static void _task_destroy(task_t *task)
     ps2_keyboard_unregister_handlers_for_task(task);
     ps2_mouse_unregister_handlers_for_task(task);
 
+    /* The user mappings go with the address space, kernel ones like the kernel stack stay */
+    if (task->state.cr3 != vmm_get_kernel_address_space())
+        vmm_destroy_address_space(task->state.cr3);
+
     if (task->memory.memblocks) {
         for (size_t i = 0; i < task->memory.memblocks_count; i++) {
             task_memblock_t *memblock = &task->memory.memblocks[i];
-            if (!memblock->release_on_exit)
-                continue;
             if (memblock->phys_addr)
-                pmm_free((void *) memblock->phys_addr, memblock->page_count);
-            if (memblock->virt_addr)
-                vmm_unmap_range(memblock->virt_addr, memblock->page_count * PAGE_SIZE, true);
+                page_put(memblock->phys_addr, memblock->page_count, true);
         }
         kfree(task->memory.memblocks);
     }
+    kfree(task->memory.regions);
 
-    kfree(task);
+    kmem_cache_free(_task_cache, task);
 }
@@ -5,6 +5,9 @@
 
 #pragma once
 
+#include <kernel/arch/pc/idt.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/memory/pmm.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -46,22 +49,47 @@ typedef struct
     uintptr_t virt_addr;
     uintptr_t flags;
     size_t page_count;
-    bool release_on_exit;
 } task_memblock_t;
 
+/*
+ * Kinds of task memory regions. The pages of a region are only allocated and mapped
+ * when the task first touches them.
+ */
+typedef enum task_region_type {
+    TASK_REGION_ANONYMOUS = 0, /* Zero filled, like the stack */
+    TASK_REGION_FILE = 1,      /* Starts with data read from a file, like ELF segments */
+} task_region_type_t;
+
+typedef struct
+{
+    task_region_type_t type;
+    uintptr_t start;      /* Page aligned */
+    uintptr_t end;        /* Page aligned */
+    uintptr_t flags;      /* Page table flags of the pages of the region */
+    file_t file;          /* File regions: file holding the data, which must outlive the task */
+    uintptr_t data_start; /* File regions: address of the first byte of data */
+    size_t data_size;     /* File regions: bytes read from the file, the rest is zeroed */
+    size_t file_offset;   /* File regions: offset of the data in the file */
+} task_region_t;
+
 typedef struct
 {
     task_memblock_t *memblocks;
     size_t memblocks_count;
     size_t memblocks_size;
+    task_region_t *regions;
+    size_t regions_count;
+    size_t regions_size;
 } task_mem_t;
 
 typedef struct task task_t;
 struct task
 {
     task_t *next;
+    size_t id; /* 0 for the idle task */
     task_state_t state;
     task_mem_t memory;
+    pmm_color_t color; /* Cache color cursor for the pages of the task */
     bool user_mode;
     bool exiting;
 };
@@ -69,13 +97,39 @@ struct task
 void task_switching_init();
 task_t *task_create(void *entry_point, task_mode_t mode);
 task_t *task_get_current();
+
+/*
+ * Create a user task running a copy of a task from the registers it saved on entry
+ * to the kernel, with 0 in rax. Pages are shared and only copied when one of the two
+ * tasks writes to them.
+ * Returns the new task, or NULL if no memory is left.
+ */
+task_t *task_fork(task_t *parent, interrupt_registers_t *regs);
+
+/*
+ * Map pages in the address space of a task, which holds a reference on them until
+ * they are mapped over or the task is destroyed.
+ * Returns 0 on success, -1 if no memory is left.
+ */
 int task_map(
     task_t *task,
     uintptr_t virt_addr,
     uintptr_t phys_addr,
     size_t page_count,
-    uintptr_t flags,
-    bool release_on_exit);
+    uintptr_t flags);
+
+/*
+ * Add a region to the address space of a task. No memory is mapped until the task
+ * touches it.
+ * Returns 0 on success, -1 if no memory is left.
+ */
+int task_add_region(task_t *task, const task_region_t *region);
+
+/*
+ * Returns the first region of a task holding an address, or NULL if there is none.
+ */
+task_region_t *task_find_region(task_t *task, uintptr_t addr);
+
 void task_remove(task_t *task);
 void task_switch(task_t *task);
 void task_mark_exiting(task_t *task);